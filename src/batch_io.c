@@ -0,0 +1,174 @@
+#define _GNU_SOURCE  /* recvmmsg/sendmmsg */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "network.h"
+#include "send_packet.h"
+#include "batch_io.h"
+
+
+void init_recv_batch(struct recv_batch *rb)
+{
+		int i;
+		memset(rb->msgs, 0, sizeof(rb->msgs));
+		for (i = 0; i < BATCH_SIZE; i++) {
+				rb->iovs[i].iov_base = rb->bufs[i];
+				rb->iovs[i].iov_len = PKT_BUFSIZE;
+				rb->msgs[i].msg_hdr.msg_iov = &rb->iovs[i];
+				rb->msgs[i].msg_hdr.msg_iovlen = 1;
+				rb->msgs[i].msg_hdr.msg_name = &rb->addrs[i];
+				rb->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		}
+		rb->count = 0;
+}
+
+void init_send_batch(struct send_batch *sb)
+{
+		int i;
+		memset(sb->msgs, 0, sizeof(sb->msgs));
+		for (i = 0; i < BATCH_SIZE; i++) {
+				sb->iovs[i].iov_base = sb->bufs[i];
+				sb->iovs[i].iov_len = PKT_HEADER_SIZE;
+				sb->msgs[i].msg_hdr.msg_iov = &sb->iovs[i];
+				sb->msgs[i].msg_hdr.msg_iovlen = 1;
+				sb->msgs[i].msg_hdr.msg_name = &sb->addrs[i];
+		}
+		sb->count = 0;
+}
+
+void init_batch_stats(struct batch_stats *stats)
+{
+		memset(stats, 0, sizeof(struct batch_stats));
+}
+
+int recv_batch(int sockfd, struct recv_batch *rb, struct batch_stats *stats)
+{
+		int i, rc;
+		/* Reset address lengths (changed by previous call) */
+		for (i = 0; i < BATCH_SIZE; i++)
+				rb->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+		/* Block for first datagram, then take whatever else is queued */
+		rc = recvmmsg(sockfd, rb->msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+		if (-1 == rc) {
+				rb->count = 0;
+				return -1;
+		}
+		rb->count = rc;
+
+		stats->recv_calls++;
+		stats->recv_pkts += rc;
+		if (rc > stats->max_recv_batch)
+				stats->max_recv_batch = rc;
+		if (rc > 0)
+				stats->recv_hist[rc - 1]++;
+
+		snprintf(debug_buf, DEBUG_BUFSIZE, "recvmmsg: %d datagrams in batch\n", rc); /* DEBUG */
+		debugf(debug_buf);  /* DEBUG */
+		return rc;
+}
+
+int queue_packet(struct send_batch *sb, struct packet *pkt, int sockfd,
+				 struct sockaddr_storage *dest_addr, socklen_t addrlen,
+				 bool lossy, struct batch_stats *stats)
+{
+		int i;
+		if (DATA == pkt->flag || pkt->pl) {
+				fprintf(stderr, "Error: only header-only packets can be batched – in queue_packet.\n");
+				return FAILURE;
+		}
+		if (BATCH_SIZE == sb->count)
+				flush_send_batch(sb, sockfd, lossy, stats);
+
+		i = sb->count;
+		memcpy(sb->bufs[i], pkt, PKT_HEADER_SIZE);
+		memcpy(&sb->addrs[i], dest_addr, addrlen);
+		sb->msgs[i].msg_hdr.msg_namelen = addrlen;
+		sb->count++;
+		return SUCCESS;
+}
+
+int flush_send_batch(struct send_batch *sb, int sockfd, bool lossy, struct batch_stats *stats)
+{
+		int i, rc, sent;
+		if (0 == sb->count)
+				return 0;
+
+		if (lossy) {
+				/* Emulated loss is only implemented by send_packet */
+				for (i = 0; i < sb->count; i++)
+						send_packet(sockfd, sb->bufs[i], PKT_HEADER_SIZE, 0,
+									(struct sockaddr*) &sb->addrs[i],
+									sb->msgs[i].msg_hdr.msg_namelen);
+				sent = sb->count;
+				stats->send_calls += sb->count;
+		} else {
+				/* sendmmsg may send fewer than asked for: continue with the rest */
+				sent = 0;
+				while (sent < sb->count) {
+						rc = sendmmsg(sockfd, &sb->msgs[sent], sb->count - sent, 0);
+						if (-1 == rc) {
+								if (EINTR == errno)
+										continue;
+								perror("flush_send_batch, sendmmsg");
+								break;
+						}
+						stats->send_calls++;
+						sent += rc;
+				}
+		}
+		stats->send_pkts += sent;
+		if (sent > stats->max_send_batch)
+				stats->max_send_batch = sent;
+
+		snprintf(debug_buf, DEBUG_BUFSIZE, "sendmmsg: %d of %d packets sent in batch\n", sent, sb->count); /* DEBUG */
+		debugf(debug_buf);  /* DEBUG */
+		/* Unsent packets are dropped (ACKs are retransmitted by the protocol anyway) */
+		sb->count = 0;
+		if (0 == sent)
+				return FAILURE;
+		return sent;
+}
+
+void add_batch_stats(struct batch_stats *sum, struct batch_stats *stats)
+{
+		int i;
+		sum->recv_calls += stats->recv_calls;
+		sum->recv_pkts += stats->recv_pkts;
+		sum->send_calls += stats->send_calls;
+		sum->send_pkts += stats->send_pkts;
+		if (stats->max_recv_batch > sum->max_recv_batch)
+				sum->max_recv_batch = stats->max_recv_batch;
+		if (stats->max_send_batch > sum->max_send_batch)
+				sum->max_send_batch = stats->max_send_batch;
+		for (i = 0; i < BATCH_SIZE; i++)
+				sum->recv_hist[i] += stats->recv_hist[i];
+}
+
+void print_batch_stats(struct batch_stats *stats)
+{
+		int i;
+		printf("\n--- Batched I/O statistics ---\n");
+		printf("recvmmsg calls: %8lu, datagrams: %8lu, avg/call: %6.2f, max: %3d\n",
+			   stats->recv_calls, stats->recv_pkts,
+			   stats->recv_calls ? (double) stats->recv_pkts / stats->recv_calls : 0.0,
+			   stats->max_recv_batch);
+		printf("send calls:     %8lu, packets:   %8lu, avg/call: %6.2f, max: %3d\n",
+			   stats->send_calls, stats->send_pkts,
+			   stats->send_calls ? (double) stats->send_pkts / stats->send_calls : 0.0,
+			   stats->max_send_batch);
+		printf("Datagrams per recvmmsg (batch size: calls):\n");
+		for (i = 0; i < BATCH_SIZE; i++)
+				if (stats->recv_hist[i])
+						printf("    %3d: %lu\n", i + 1, stats->recv_hist[i]);
+}
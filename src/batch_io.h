@@ -0,0 +1,111 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+/* struct mmsghdr requires _GNU_SOURCE to be defined before first include */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "my_constants.h"
+#include "network.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Max number of datagrams received (or sent) per syscall */
+#define BATCH_SIZE 32
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Ring of PKT_BUFSIZE receive buffers, filled by one recvmmsg call.
+ * Use init_recv_batch before first use.
+ *
+ * count: number of datagrams received in last call.
+ * bufs:  one buffer per datagram, datagram i is in bufs[i] (msgs[i].msg_len bytes).
+ * addrs: sender address of datagram i (msgs[i].msg_hdr.msg_namelen bytes).
+ */
+struct recv_batch {
+		int count;
+		char bufs[BATCH_SIZE][PKT_BUFSIZE];
+		struct sockaddr_storage addrs[BATCH_SIZE];
+		struct iovec iovs[BATCH_SIZE];
+		struct mmsghdr msgs[BATCH_SIZE];
+};
+
+/* Header-only packets (ACKs/TERMs) queued for one sendmmsg call.
+ * count: number of packets queued.
+ */
+struct send_batch {
+		int count;
+		char bufs[BATCH_SIZE][PKT_HEADER_SIZE];
+		struct sockaddr_storage addrs[BATCH_SIZE];
+		struct iovec iovs[BATCH_SIZE];
+		struct mmsghdr msgs[BATCH_SIZE];
+};
+
+/* Statistics on how well batching works.
+ * recv_hist[i]: number of recvmmsg calls which returned i+1 datagrams.
+ */
+struct batch_stats {
+		unsigned long recv_calls;
+		unsigned long recv_pkts;
+		unsigned long send_calls;
+		unsigned long send_pkts;
+		int max_recv_batch;
+		int max_send_batch;
+		unsigned long recv_hist[BATCH_SIZE];
+};
+
+
+/* ==============================
+ * ====== BATCH FUNCTIONS =======
+ * ==============================
+ */
+
+/* Point iovecs and msg headers of rb at its buffers */
+void init_recv_batch(struct recv_batch *rb);
+
+/* Set queue of sb empty */
+void init_send_batch(struct send_batch *sb);
+
+/* Set all counters in stats to 0 */
+void init_batch_stats(struct batch_stats *stats);
+
+/* Receive as many datagrams as are available (max BATCH_SIZE) with one recvmmsg.
+ * Blocks until at least one datagram arrives (or socket timeout).
+ * On a non-blocking socket, returns -1 (errno EAGAIN) if none are waiting.
+ * Returns number of datagrams received (also in rb->count), or -1 on error (errno set).
+ */
+int recv_batch(int sockfd, struct recv_batch *rb, struct batch_stats *stats);
+
+/* Copy header of ACK/TERM-packet pkt into next free slot of sb, addressed to dest_addr.
+ * Flushes batch first if it is full.
+ * Returns SUCCESS, or FAILURE if packet has a payload (only header-only packets are batched).
+ */
+int queue_packet(struct send_batch *sb, struct packet *pkt, int sockfd,
+				 struct sockaddr_storage *dest_addr, socklen_t addrlen,
+				 bool lossy, struct batch_stats *stats);
+
+/* Send all queued packets with one sendmmsg and empty the queue.
+ * If lossy is set, each packet is sent with send_packet instead, so that
+ * emulated packet loss still applies.
+ * Returns number of packets sent, or FAILURE.
+ */
+int flush_send_batch(struct send_batch *sb, int sockfd, bool lossy, struct batch_stats *stats);
+
+/* Adds counters of stats to sum (maximums are the largest of both) */
+void add_batch_stats(struct batch_stats *sum, struct batch_stats *stats);
+
+/* Print statistics (always, not only in debug mode) */
+void print_batch_stats(struct batch_stats *stats);
+
+#endif /* BATCH_IO_H */
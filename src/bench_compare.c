@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "files.h"
+#include "pgmread.h"
+#include "image_cmp.h"
+#include "pgm.h"
+#include "rtt.h"
+
+/* Benchmark of pixel compare kernels against Image_compare.
+ * Every image in a directory is decoded twice, and the two copies compared
+ * (equal images: whole image is compared, the worst case).
+ */
+
+/* Necessary for formatted debug printing (used by files.c) */
+__thread char debug_buf[DEBUG_BUFSIZE];
+int debug_mode;
+
+#define DEFAULT_ROUNDS 2000
+
+/* Decoded copies of the images */
+struct image_pairs {
+		int entries;
+		struct Image **a;
+		struct Image **b;
+		size_t pixels;
+};
+
+/* Returns number of equal pairs found by kernel k (Image_compare if k is NULL),
+ * and prints time used.
+ */
+static long run(struct image_pairs *pairs, const char *name, pixel_kernel k, int rounds)
+{
+		struct timespec start, end;
+		long equal, us;
+		int r, i;
+		equal = 0;
+		get_time(&start);
+		for (r = 0; r < rounds; r++) {
+				for (i = 0; i < pairs->entries; i++) {
+						if (NULL == k)
+								equal += (1 == Image_compare(pairs->a[i], pairs->b[i]));
+						else
+								equal += (pairs->a[i]->width == pairs->b[i]->width
+										  && pairs->a[i]->height == pairs->b[i]->height
+										  && k((unsigned char*) pairs->a[i]->data,
+											   (unsigned char*) pairs->b[i]->data,
+											   (size_t) pairs->a[i]->width * pairs->a[i]->height));
+				}
+		}
+		get_time(&end);
+		us = time_diff_us(&end, &start);
+		printf("%-14s %10.1f ns/compare %10.2f GB/s   (%ld equal)\n", name,
+			   us * 1000.0 / ((double) rounds * pairs->entries),
+			   us ? (double) pairs->pixels * rounds / (us * 1000.0) : 0.0,
+			   equal);
+		return equal;
+}
+
+int main(int argc, char *argv[])
+{
+		struct string_array sa;
+		struct file_array fa;
+		struct image_pairs pairs;
+		const char *kernels[3] = { "scalar", "sse2", "avx2" };
+		int i, rounds;
+
+		if (argc < 2 || argc > 3) {
+				printf("Usage: ./bench_compare <directory w/imgs> [<rounds>]\n");
+				exit(EXIT_FAILURE);
+		}
+		debug_mode = false;
+		rounds = (3 == argc) ? atoi(argv[2]) : DEFAULT_ROUNDS;
+		if (rounds < 1)
+				rounds = DEFAULT_ROUNDS;
+
+		sa.entries = 0; sa.total_size = 0;
+		realloc_byte_array((struct byte_array*)&sa);
+		fa.entries = 0; fa.total_size = 0;
+		realloc_byte_array((struct byte_array*)&fa);
+		read_strings_from_dir(&sa, argv[1]);
+		for (i = 0; i < sa.entries; i++)
+				add_file_to_array(&fa, sa.strings[i]);
+
+		pairs.entries = 0;
+		pairs.pixels = 0;
+		pairs.a = malloc(fa.entries * sizeof(struct Image*));
+		pairs.b = malloc(fa.entries * sizeof(struct Image*));
+		if (NULL == pairs.a || NULL == pairs.b) {
+				perror("bench_compare: malloc");
+				exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < fa.entries; i++) {
+				pairs.a[pairs.entries] = decode_file(fa.files[i]);
+				pairs.b[pairs.entries] = decode_file(fa.files[i]);
+				if (NULL == pairs.a[pairs.entries] || NULL == pairs.b[pairs.entries]) {
+						fprintf(stderr, "Could not decode %s, skipped.\n", fa.files[i]->filename);
+						if (pairs.a[pairs.entries]) pgm_free(pairs.a[pairs.entries]);
+						if (pairs.b[pairs.entries]) pgm_free(pairs.b[pairs.entries]);
+						continue;
+				}
+				pairs.pixels += (size_t) pairs.a[pairs.entries]->width * pairs.a[pairs.entries]->height;
+				pairs.entries++;
+		}
+		if (0 == pairs.entries) {
+				fprintf(stderr, "No images to compare. Exiting.\n");
+				exit(EXIT_FAILURE);
+		}
+
+		printf("%d images, %lu pixels, %d rounds. pixels_equal uses: %s\n",
+			   pairs.entries, (unsigned long) pairs.pixels, rounds, pixel_kernel_name());
+		run(&pairs, "Image_compare", NULL, rounds);
+		for (i = 0; i < 3; i++) {
+				if (get_pixel_kernel(kernels[i]))
+						run(&pairs, kernels[i], get_pixel_kernel(kernels[i]), rounds);
+				else
+						printf("%-14s not supported by this CPU\n", kernels[i]);
+		}
+
+		for (i = 0; i < pairs.entries; i++) {
+				pgm_free(pairs.a[i]);
+				pgm_free(pairs.b[i]);
+		}
+		free(pairs.a);
+		free(pairs.b);
+		free_file_array(&fa);
+		free_string_array(&sa);
+		return 0;
+}
@@ -15,37 +15,584 @@
 #include "debug_print.h"
 #include "network.h"
 #include "files.h"
+#include "rtt.h"
+#include "cwnd.h"
 #include "send_packet.h"
 
 
 /* Necessary for formatted debug printing.
  * Also used by external functions.
  */
-char debug_buf[DEBUG_BUFSIZE];
+__thread char debug_buf[DEBUG_BUFSIZE];
 int debug_mode;
 
+/* File loaded for sending. Packets point into its bytes (nothing is copied),
+ * so it is kept until all its packets are ACKed, and then freed.
+ *
+ * f:       the file.
+ * id:      payload id of file.
+ * pending: number of its packets in the window (not yet ACKed).
+ * next:    next file in queue (loaded after this one).
+ */
+struct queued_file {
+		struct file *f;
+		int32_t id;
+		uint32_t pending;
+		struct queued_file *next;
+};
+
+/* State of the sending side, used by the protocol functions below.
+ *
+ * sockfd:             socket (non-blocking).
+ * dest_addr, addrlen: address of server.
+ * selective_repeat:   send with Selective Repeat instead of Go-Back-N.
+ * lossy:              loss emulation is on (packets must go through send_packet,
+ *                     otherwise they are sent without copying with send_packet_iov).
+ * rtt:                round trip time estimator, gives retransmission timeout.
+ * cw:                 congestion window.
+ * timeouts:           number of timeouts (for statistics).
+ * retransmissions:    number of packets resent (for statistics).
+ * sends:              number of transmissions, gives sent_order of packets.
+ * acked_order:        sent_order of packet which triggered the last ACK.
+ * in_recovery:        loss episode in progress: a timeout has been reacted to,
+ *                     and the packets in flight then are not all ACKed yet.
+ * recover:            seqnum which ends the loss episode when ACKed cumulatively.
+ * filenames:          paths of files to send (files are loaded as they are needed).
+ * next_filename:      index of next filename to load.
+ * map:                memory map files instead of reading them (-m).
+ * send_p5:            convert files to P5 when loaded (-5).
+ * files:              queue of loaded files, oldest first (see struct queued_file).
+ * current:            file in queue the next fragment is taken from (NULL if none loaded).
+ * file_offset:        offset of next fragment in that file.
+ * payload_identifier: payload id of next file loaded.
+ * n_loaded, bytes_loaded:   files (and their bytes) in queue.
+ * max_loaded, max_bytes:    most files (and bytes) in queue at once (for statistics).
+ * bytes_before, bytes_after: bytes of files before and after conversion to P5 (for statistics).
+ * seqnum:             sequence number of next new packet (wraps around at 2^32).
+ * seqnum_last_recv:   seqnum of last ACK received.
+ * window:             max number of packets in flight (-w), advertised to server.
+ * peer_window:        window advertised by server in its ACKs (0 until first ACK).
+ * in_flight:          number of packets in list <head>.
+ * head:               list of sent packets not yet ACKed (the window).
+ * next_resend:        Go-Back-N: first packet in list not yet resent since last timeout
+ *                     (NULL if all are sent).
+ * pkt_buffer:         buffer used when receiving (and sending if lossy).
+ */
+struct sender {
+		int sockfd;
+		struct sockaddr *dest_addr;
+		socklen_t addrlen;
+		bool selective_repeat;
+		bool lossy;
+		struct rtt_estimator rtt;
+		struct congestion_window cw;
+		unsigned long timeouts;
+		unsigned long retransmissions;
+		unsigned long sends;
+		unsigned long acked_order;
+		bool in_recovery;
+		uint32_t recover;
+		struct string_array *filenames;
+		int next_filename;
+		bool map;
+		bool send_p5;
+		struct queued_file *files;
+		struct queued_file *current;
+		int32_t file_offset;
+		int32_t payload_identifier;
+		int n_loaded;
+		long bytes_loaded;
+		int max_loaded;
+		long max_bytes;
+		long bytes_before;
+		long bytes_after;
+		uint32_t seqnum;
+		uint32_t seqnum_last_recv;
+		uint32_t window;
+		uint32_t peer_window;
+		uint32_t in_flight;
+		struct node *head;
+		struct node *next_resend;
+		char pkt_buffer[PKT_BUFSIZE];
+};
+
+/* Loads next file in filenames (converted to P5 if send_p5), and adds it last in queue.
+ * Files which can't be loaded are skipped. Returns the queued file, or NULL if no files are left.
+ */
+static struct queued_file *load_next_file(struct sender *snd)
+{
+		struct queued_file *qf, **last;
+		struct file *f;
+		char *filename;
+
+		while (snd->next_filename < snd->filenames->entries) {
+				filename = snd->filenames->strings[snd->next_filename++];
+				f = snd->map ? map_file(filename) : get_file(filename);
+				if (NULL == f) {
+						fprintf(stderr, "Error in load_next_file: skipping file '%s'.\n", filename);
+						continue;
+				}
+				/* Files which can't be decoded are sent as they are */
+				if (snd->send_p5) {
+						snd->bytes_before += f->n_bytes;
+						convert_to_p5(f);
+						snd->bytes_after += f->n_bytes;
+				}
+				qf = malloc(sizeof(struct queued_file));
+				if (NULL == qf) {
+						perror("load_next_file, malloc");
+						free_file(f);
+						continue;
+				}
+				debug_print_file(f);  /* DEBUG */
+				qf->f = f;
+				qf->id = snd->payload_identifier++;
+				qf->pending = 0;
+				qf->next = NULL;
+				for (last = &snd->files; *last != NULL; last = &(*last)->next) {;}
+				*last = qf;
+				snd->n_loaded++;
+				snd->bytes_loaded += f->n_bytes;
+				if (snd->n_loaded > snd->max_loaded)
+						snd->max_loaded = snd->n_loaded;
+				if (snd->bytes_loaded > snd->max_bytes)
+						snd->max_bytes = snd->bytes_loaded;
+				return qf;
+		}
+		return NULL;
+}
+
+/* Frees files at the front of queue which are completely sent and ACKed */
+static void release_files(struct sender *snd)
+{
+		struct queued_file *qf;
+		while (snd->files && snd->files != snd->current && 0 == snd->files->pending) {
+				qf = snd->files;
+				snd->files = qf->next;
+				snd->n_loaded--;
+				snd->bytes_loaded -= qf->f->n_bytes;
+				free_file(qf->f);
+				free(qf);
+		}
+}
+
+/* Loads the file after the current one, so it is ready when the current file is sent */
+static void load_ahead(struct sender *snd)
+{
+		if (snd->current && NULL == snd->current->next)
+				load_next_file(snd);
+}
+
+/* Prepares the next DATA-packet (file fragment) to send, or returns NULL if all files are sent.
+ * current and file_offset give the position of the next fragment, and are moved past it.
+ * Files are loaded as the fragments reach them.
+ */
+static struct packet *next_data_packet(struct sender *snd)
+{
+		struct packet *pkt;
+		struct queued_file *qf;
+		struct file *f;
+		for (;;) {
+				if (NULL == snd->current)
+						snd->current = load_next_file(snd);
+				qf = snd->current;
+				if (NULL == qf)
+						return NULL;
+				f = qf->f;
+				pkt = prep_packet(DATA, snd->seqnum, snd->seqnum_last_recv, snd->window,
+								  f, qf->id, snd->file_offset);
+				if (pkt) {
+						snd->file_offset += fragment_size(f, snd->file_offset);
+						qf->pending++;
+				} else {
+						fprintf(stderr, "Skipping file '%s'.\n", f->filename);
+				}
+				/* Whole file sent (or skipped): move on to next file */
+				if (NULL == pkt || snd->file_offset >= f->n_bytes) {
+						snd->current = qf->next;
+						snd->file_offset = 0;
+						release_files(snd);
+				}
+				if (pkt) {
+						snd->seqnum += 1;
+						return pkt;
+				}
+		}
+}
+
+/* Number of packets allowed in flight: the smallest of
+ * own window, the server's window (flow control) and the congestion window.
+ */
+static uint32_t send_window(struct sender *snd)
+{
+		uint32_t w;
+		w = snd->window;
+		if (snd->peer_window > 0 && snd->peer_window < w)
+				w = snd->peer_window;
+		if (cwnd_get(&snd->cw) < w)
+				w = cwnd_get(&snd->cw);
+		return w;
+}
+
+/* Adds packet to end of window (without sending it). Returns the new node. */
+static struct node *push_packet(struct sender *snd, struct packet *pkt)
+{
+		snd->in_flight++;
+		return add_node(&snd->head, pkt);
+}
+
+/* Removes (and frees) oldest packet in window, and the files no longer needed */
+static void pop_packet(struct sender *snd)
+{
+		struct queued_file *qf;
+		int32_t id;
+		if (snd->next_resend == snd->head)
+				snd->next_resend = snd->head->next;
+		id = ntohl(snd->head->pkt->pl->id);
+		for (qf = snd->files; qf != NULL; qf = qf->next) {
+				if (qf->id == id) {
+						qf->pending--;
+						break;
+				}
+		}
+		snd->in_flight--;
+		remove_head(&snd->head);
+		release_files(snd);
+}
+
+/* Sends packet of node n, and sets its timestamp to the time it times out
+ * (current retransmission timeout from now).
+ */
+static int send_node(struct sender *snd, struct node *n)
+{
+		struct timespec current_time;
+		int wc;
+		if (snd->lossy)
+				wc = load_and_send_packet(n->pkt,
+										  snd->pkt_buffer,
+										  snd->sockfd,
+										  snd->dest_addr,
+										  snd->addrlen);
+		else
+				wc = send_packet_iov(n->pkt, snd->sockfd, snd->dest_addr, snd->addrlen);
+		get_time(&current_time);
+		if (0 == n->transmissions)
+				n->sent_time = current_time;
+		else
+				snd->retransmissions++;
+		n->transmissions++;
+		n->sent_order = ++snd->sends;
+		n->timestamp = current_time;
+		time_add_us(&n->timestamp, rtt_rto(&snd->rtt));
+		snprintf(debug_buf, DEBUG_BUFSIZE, "Sent %d bytes\n\n", wc);  /* DEBUG */
+		debugf(debug_buf);                                            /* DEBUG */
+		return wc;
+}
+
+/* Packet of node n has been ACKed: take an RTT sample,
+ * unless packet has been retransmitted (Karn's rule: ambiguous sample).
+ */
+static void sample_rtt(struct sender *snd, struct node *n)
+{
+		struct timespec current_time;
+		if (1 != n->transmissions)
+				return;
+		get_time(&current_time);
+		rtt_sample(&snd->rtt, time_diff_us(&current_time, &n->sent_time));
+}
+
+/* Packet of node n timed out: back off retransmission timeout, and shrink
+ * congestion window, once per loss episode. Packets sent before the episode
+ * started which time out during it belong to the loss already reacted to
+ * (a Go-Back-N server drops everything after a lost packet, so they all time out).
+ * Only a resent packet timing out again backs off further.
+ */
+static void handle_timeout(struct sender *snd, struct node *n)
+{
+		snd->timeouts++;
+		if (!snd->in_recovery) {
+				cwnd_loss(&snd->cw, snd->in_flight);
+				rtt_backoff(&snd->rtt);
+				snd->in_recovery = true;
+				snd->recover = snd->seqnum;
+		} else if (n->transmissions > 1) {
+				rtt_backoff(&snd->rtt);
+		}
+		printf("- Timeout - (timeout is now %ld ms, cwnd %u)\n",
+			   rtt_rto(&snd->rtt) / 1000, cwnd_get(&snd->cw));
+}
+
+/* Adds new packets to window (and sends them) while there is room
+ * and more fragments to send, and then loads the next file while waiting for ACKs.
+ * Returns number of packets added.
+ */
+static int fill_window(struct sender *snd)
+{
+		struct packet *pkt;
+		struct node *n;
+		int added;
+		added = 0;
+		while (snd->in_flight < send_window(snd) && (pkt = next_data_packet(snd))) {
+				n = push_packet(snd, pkt);
+				printf("Packet seqnum: %u\n", ntohl(pkt->seqnum));
+				send_node(snd, n);
+				added++;
+		}
+		load_ahead(snd);
+		return added;
+}
+
+/* Go-Back-N: resends packets from next_resend and on, as long as they are inside the window.
+ * Packets which don't fit are resent later, as ACKs move the window.
+ */
+static void resend_pending(struct sender *snd)
+{
+		struct node *n;
+		uint32_t i, w;
+		w = send_window(snd);
+		for (n = snd->head, i = 0; n != NULL && snd->next_resend != NULL && i < w; n = n->next, i++) {
+				if (n == snd->next_resend) {
+						send_node(snd, n);
+						snd->next_resend = n->next;
+				}
+		}
+}
+
+/* Waits until a packet can be read from socket, or until <deadline>.
+ * Returns true if there is a packet to read, false on timeout.
+ */
+static bool wait_for_packet(struct sender *snd, struct timespec *deadline)
+{
+		struct timespec current_time;
+		struct timeval timeout;
+		fd_set readfds;
+		long remaining;
+
+		/* Reset select-set each time */
+		FD_ZERO(&readfds);
+		FD_SET(snd->sockfd, &readfds);
+
+		/* Remaining time before deadline.
+		 * If clock has passed deadline: no wait.
+		 */
+		get_time(&current_time);
+		remaining = time_diff_us(deadline, &current_time);
+		if (remaining < 0)
+				remaining = 0;
+		timeout.tv_sec = remaining / 1000000L;
+		timeout.tv_usec = remaining % 1000000L;
+		/* DEBUG */
+		snprintf(debug_buf, DEBUG_BUFSIZE,
+				 "Current time to timeout (sec): "YEL"%ld.%06ld"NRM"\n",
+				 timeout.tv_sec, timeout.tv_usec);
+		debugf(debug_buf);
+
+		/* Wait for ACK */
+		debug("Waiting for ACK\n");
+		if (select(snd->sockfd+1, &readfds, NULL, NULL, &timeout) == -1)
+				perror("select");
+		return FD_ISSET(snd->sockfd, &readfds);
+}
+
+/* Reads one packet from socket. Returns the packet header if it is a valid ACK,
+ * NULL otherwise (warning is printed for unknown packets).
+ * Window advertised by server is taken from the ACK.
+ */
+static struct packet *recv_ack(struct sender *snd)
+{
+		struct packet *ack_pkt;
+		int rc;
+		rc = recv(snd->sockfd, snd->pkt_buffer, PKT_BUFSIZE, 0);
+		if (rc < PKT_HEADER_SIZE)
+				return NULL;
+		ack_pkt = get_packet_header(snd->pkt_buffer);
+		if (NULL == ack_pkt || ACK != ack_pkt->flag) {
+				fprintf(stderr, RED "Warning:" NRM " received unknown packet.\n");
+				free_packet(ack_pkt);
+				return NULL;
+		}
+		if (ntohs(ack_pkt->window) > 0)
+				snd->peer_window = ntohs(ack_pkt->window);
+		debug("Received ACK");             /* DEBUG */
+		debug_print_packet_meta(ack_pkt);  /* DEBUG */
+		return ack_pkt;
+}
+
+/* Handles an ACK. Its seqnum is the next seqnum the server expects, so all packets
+ * before it have arrived (cumulative ACK), and its seqnum_last_recv is the packet
+ * which triggered the ACK (ACKed individually, used by Selective Repeat).
+ * ACKed packets at the front of the window are released, however many they are,
+ * so a lost ACK is covered by any later one. Returns number of packets released.
+ */
+static uint32_t handle_ack(struct sender *snd, struct packet *ack_pkt)
+{
+		struct node *n;
+		uint32_t cum_ack, acked_seqnum, head_seqnum, covered, acked_idx, walk, i, released;
+
+		cum_ack = ntohl(ack_pkt->seqnum);
+		acked_seqnum = ntohl(ack_pkt->seqnum_last_recv);
+		snd->seqnum_last_recv = cum_ack;
+		/* Loss episode is over once all packets in flight when it started are ACKed */
+		if (snd->in_recovery && (int32_t) (cum_ack - snd->recover) >= 0)
+				snd->in_recovery = false;
+		if (NULL == snd->head)
+				return 0;
+
+		/* Positions (from head) of packets covered by the ACK.
+		 * Stale or duplicate ACKs (for packets already released) are outside the window.
+		 */
+		head_seqnum = ntohl(snd->head->pkt->seqnum);
+		covered = cum_ack - head_seqnum;
+		if (covered > snd->in_flight)
+				covered = 0;
+		acked_idx = acked_seqnum - head_seqnum;
+		walk = covered;
+		if (acked_idx < snd->in_flight && acked_idx >= walk)
+				walk = acked_idx + 1;
+
+		for (n = snd->head, i = 0; n != NULL && i < walk; n = n->next, i++) {
+				if (i == acked_idx && n->sent_order > snd->acked_order)
+						snd->acked_order = n->sent_order;
+				if ((i < covered || i == acked_idx) && !n->acked) {
+						/* RTT is sampled from the packet which triggered the ACK only */
+						if (i == acked_idx)
+								sample_rtt(snd, n);
+						cwnd_ack(&snd->cw);
+						n->acked = true;
+				}
+		}
+
+		/* Slide window past ACKed packets at the front */
+		released = 0;
+		while (snd->head && snd->head->acked) {
+				pop_packet(snd);
+				released++;
+		}
+		printf("ACK: next expected "GRN"%u"NRM", packet "GRN"%u"NRM", released %u packet(s)\n",
+			   cum_ack, acked_seqnum, released);
+		return released;
+}
+
+/* Go-Back-N: on timeout the window is resent from the oldest packet,
+ * but no more packets than the (shrunk) congestion window allows at once.
+ * Every ACK moves the window past all packets it covers (cumulative ACK).
+ */
+static void run_go_back_n(struct sender *snd)
+{
+		struct packet *ack_pkt;
+
+		/* Send as many packets as the window allows */
+		fill_window(snd);
+
+		/* Continue as long as there are packets in window to send.
+		 * Timeout is given by timestamp of oldest packet.
+		 */
+		while (snd->in_flight > 0) {
+				if (!wait_for_packet(snd, &snd->head->timestamp)) {
+						handle_timeout(snd, snd->head);
+						printf(YEL "RESENDING WINDOW\n"NRM);
+						snd->next_resend = snd->head;
+						resend_pending(snd);
+						continue;
+				}
+				/* Packet received */
+				ack_pkt = recv_ack(snd);
+				if (NULL == ack_pkt)
+						continue;
+
+				/* Release all packets ACKed. Then send packets left over
+				 * from last resend, and new packets (if more fragments to send).
+				 */
+				if (handle_ack(snd, ack_pkt) > 0) {
+						resend_pending(snd);
+						fill_window(snd);
+				}
+				free_packet(ack_pkt); ack_pkt = NULL;
+		}
+}
+
+/* Selective Repeat: packets not ACKed, which were sent before the packet which triggered
+ * the last ACK, are taken as lost and resent at once, as long as they are inside the window.
+ * They are not waited on: a Go-Back-N server discards packets after a gap, so when
+ * the resent packet filling the gap is ACKed, the packets after it will not be.
+ */
+static void resend_overtaken(struct sender *snd)
+{
+		struct node *n;
+		uint32_t i, w;
+		w = send_window(snd);
+		for (n = snd->head, i = 0; n != NULL && i < w; n = n->next, i++) {
+				if (!n->acked && n->sent_order < snd->acked_order) {
+						printf(YEL "RESENDING PACKET %u\n"NRM, ntohl(n->pkt->seqnum));
+						send_node(snd, n);
+				}
+		}
+}
+
+/* Selective Repeat: each packet is ACKed individually and has its own timer
+ * (ACKs are also cumulative, covering every packet before the next expected).
+ * On timeout only the packets which timed out are resent,
+ * and no new packets are sent until fewer than cwnd packets are in flight.
+ * The window advances past the oldest packets as soon as they are ACKed.
+ * Packets sent before an ACKed packet are resent without waiting for their timers
+ * (resend_overtaken), so a Go-Back-N server is also served without a timeout per packet.
+ */
+static void run_selective_repeat(struct sender *snd)
+{
+		struct packet *ack_pkt;
+		struct node *n, *first;
+		struct timespec current_time;
+
+		fill_window(snd);
+
+		while (snd->in_flight > 0) {
+				/* Wait for ACK, or until the first unacked packet times out */
+				first = NULL;
+				for (n = snd->head; n != NULL; n = n->next)
+						if (!n->acked && (NULL == first || time_diff_us(&n->timestamp, &first->timestamp) < 0))
+								first = n;
+
+				if (first && !wait_for_packet(snd, &first->timestamp)) {
+						/* Resend only packets which have timed out */
+						handle_timeout(snd, first);
+						get_time(&current_time);
+						for (n = snd->head; n != NULL; n = n->next) {
+								if (!n->acked && time_diff_us(&current_time, &n->timestamp) >= 0) {
+										printf(YEL "RESENDING PACKET %u\n"NRM, ntohl(n->pkt->seqnum));
+										send_node(snd, n);
+								}
+						}
+						continue;
+				}
+
+				ack_pkt = recv_ack(snd);
+				if (NULL == ack_pkt)
+						continue;
+				/* Mark packet (and all before next expected) as ACKed,
+				 * slide window past ACKed packets at the front, and refill it.
+				 */
+				if (handle_ack(snd, ack_pkt) > 0)
+						fill_window(snd);
+				resend_overtaken(snd);
+				free_packet(ack_pkt);
+		}
+}
+
 int main(int argc, char *argv[])
 {
 		/* Network declarations */
 		struct addrinfo hints, *addrs, *addr_ptr;
-		struct packet *pkt, *ack_pkt;
-		struct node *head, *n;
-		struct timeval default_timeout, current_time, timeout;
-		fd_set readfds;
-		int result, sockfd, wc, max_no_seqnums;
-		int32_t payload_identifier;
-		uint8_t seqnum, seqnum_last_recv;
-		char pkt_buffer[PKT_BUFSIZE];
+		struct packet *pkt;
+		struct sender snd;
+		int result, sockfd, i;
 
 		/* Data handling & file declarations */
 		struct string_array filenames;
-		struct file_array file_arr;
-		int file_idx;
-		char *filename;
+		struct queued_file *qf;
 
 		/* Check arguments */
-		if (!(argc == 5 || argc == 6)) {
-				printf("Usage: ./client <ipv4-address/hostname> <portnum> <list of filenames (txt-file)> <loss-percentage (int)> [-d]\n");
+		if (argc < 5 || argc > 11) {
+				printf("Usage: ./client <ipv4-address/hostname> <portnum> <list of filenames (txt-file)> <loss-percentage (int)> [-d] [-s] [-w <window>] [-5] [-m]\n");
 				printf("%d arguments supplied:\n", argc);
 				print_array(argv, argc);
 				fprintf(stderr, "Exiting.\n");
@@ -55,11 +602,40 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 		}
 
-		if (argc == 6 && (strcmp(argv[5], "-d") == 0)) {
-				printf("----- DEBUG MODE -----\n");
-				debug_mode = 1;
-		} else {
-				debug_mode = 0;
+		/* Check optionals.
+		 * -d: debug mode, -s: Selective Repeat instead of Go-Back-N,
+		 * -w <n>: window size (1 to MAX_WINSIZE, server may reduce it),
+		 * -5: send images as P5 (binary), converted from P2 when loaded,
+		 * -m: memory map files instead of reading them.
+		 */
+		debug_mode = 0;
+		snd.send_p5 = false;
+		snd.map = false;
+		snd.selective_repeat = false;
+		snd.window = DEFAULT_WINSIZE;
+		for (i = 5; i < argc; i++) {
+				if (strcmp(argv[i], "-d") == 0) {
+						printf("----- DEBUG MODE -----\n");
+						debug_mode = 1;
+				} else if (strcmp(argv[i], "-s") == 0) {
+						printf("----- SELECTIVE REPEAT -----\n");
+						snd.selective_repeat = true;
+				} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+						i++;
+						if (atoi(argv[i]) < 1 || atoi(argv[i]) > MAX_WINSIZE) {
+								fprintf(stderr, "Window size must be between 1 and %d. Exiting.\n", MAX_WINSIZE);
+								exit(EXIT_FAILURE);
+						}
+						snd.window = atoi(argv[i]);
+				} else if (strcmp(argv[i], "-5") == 0) {
+						printf("----- SENDING P5 -----\n");
+						snd.send_p5 = true;
+				} else if (strcmp(argv[i], "-m") == 0) {
+						snd.map = true;
+				} else {
+						fprintf(stderr, "Unknown option '%s'. Exiting.\n", argv[i]);
+						exit(EXIT_FAILURE);
+				}
 		}
 
 		/* DEBUG: Print arguments */
@@ -68,7 +644,7 @@ int main(int argc, char *argv[])
 		debug_print_array(argv, argc);                           /* DEBUG */
 
 		/* Ensure pkt buffer is zero */
-		memset(pkt_buffer, 0, PKT_BUFSIZE);
+		memset(snd.pkt_buffer, 0, PKT_BUFSIZE);
 
 
 		/* ----- NETWORK ----- */
@@ -120,167 +696,79 @@ int main(int argc, char *argv[])
 		read_strings_from_file(&filenames, argv[3]);
 		debug_print_filenames(&filenames);    /* DEBUG */
 
-		/* Important: must also be initalized to 0. */
-		file_arr.entries = 0;
-		file_arr.total_size = 0;
-		realloc_byte_array((struct byte_array*)&file_arr);
-
-		/* Read all files listed in filenames-array, and load to file-struct-array */
-		int i;
-		for (i = 0; i < filenames.entries; i++) {
-				filename = filenames.strings[i];
-				add_file_to_array(&file_arr, filename);
-		}
-
-		debug_print_file_array(&file_arr);
-
 		/* Set loss probability */
 		float p = ((float) atoi(argv[4])) / 100;
 		set_loss_probability(p);
+		snd.lossy = (p > 0.0f);
 
 		snprintf(debug_buf, DEBUG_BUFSIZE, "Loss probability set to %f.\n", p);
 		debugf(debug_buf);
 
-		/* Set up Select */
-		default_timeout.tv_sec = 5;
-		default_timeout.tv_usec = 0;
-		timeout = default_timeout;
-		FD_ZERO(&readfds);
-		FD_SET(sockfd, &readfds);
-
+		/* ----- SENDER STATE ----- */
+		snd.sockfd = sockfd;
+		snd.dest_addr = addr_ptr->ai_addr;
+		snd.addrlen = addr_ptr->ai_addrlen;
+		rtt_init(&snd.rtt);
+		snd.timeouts = 0;
+		snd.retransmissions = 0;
+		snd.sends = 0;
+		snd.acked_order = 0;
+		snd.in_recovery = false;
+		snd.recover = 0;
+		/* Files are loaded as they are sent (and freed when ACKed),
+		 * so only the files of the packets in the window are in memory.
+		 */
+		snd.filenames = &filenames;
+		snd.next_filename = 0;
+		snd.files = NULL;
+		snd.current = NULL;
+		snd.n_loaded = 0;
+		snd.bytes_loaded = 0;
+		snd.max_loaded = 0;
+		snd.max_bytes = 0;
+		snd.bytes_before = 0;
+		snd.bytes_after = 0;
 		/* Sequence numbers and payload info */
-		seqnum = 0;
-		seqnum_last_recv = 0;  /* Strictly speaking not relevant client-side */
-		max_no_seqnums = WINSIZE + 1;
-		file_idx = 0;
-		payload_identifier = 0;
+		snd.seqnum = 0;
+		snd.seqnum_last_recv = 0;  /* Strictly speaking not relevant client-side */
+		snd.peer_window = 0;
+		snd.in_flight = 0;
+		cwnd_init(&snd.cw, snd.window);
+		snd.file_offset = 0;
+		snd.payload_identifier = 0;
 		/* For list*/
-		pkt = NULL;
-		head = NULL;
-
-		/* Fill linked list up to WINSIZE and while more packets to send */
-		/* while (listsize(&head) < WINSIZE && file_arr[file_idx]) */
-		while (listsize(&head) < WINSIZE && file_arr.files[file_idx]) {
-				pkt = prep_packet(DATA,
-								  seqnum,
-								  seqnum_last_recv,
-								  file_arr.files[file_idx++],
-								  payload_identifier++);
-				add_node(&head, pkt);
-				seqnum = (seqnum + 1) % max_no_seqnums;
-		}
-
-		/* Sending packets to server.
-		 * Continue as long as there are packets in window to send.
-		 */
-		while ((listsize(&head) > 0)) {
-
-				/* (Re)sending whole window */
-				printf(YEL "RESENDING WHOLE WINDOW\n"NRM);
-				for (n = head; n != NULL; n = n->next) {
-						wc = load_and_send_packet(n->pkt,
-												  pkt_buffer,
-												  sockfd,
-												  addr_ptr->ai_addr,
-												  addr_ptr->ai_addrlen);
-						/* Timestamp node (when timeout occurs)*/
-						gettimeofday(&current_time, NULL);
-						timeradd(&current_time, &default_timeout, &(head->timestamp));
-						snprintf(debug_buf, DEBUG_BUFSIZE, "Sent %d bytes\n\n", wc);  /* DEBUG */
-						debugf(debug_buf);                                            /* DEBUG */
-				}
+		snd.head = NULL;
+		snd.next_resend = NULL;
 
-				/* Incrementally advancing send window for each ACK.
-				 * Continues as long as there are packets in window to send.
-				 */
-				while (listsize(&head) > 0) {
-						/* Reset select-set each time */
-						FD_SET(sockfd, &readfds);
-
-						/* Reset time according to timestamp of oldest packet
-						 * (remaining time before next timeout)
-						 */
-						gettimeofday(&current_time, NULL);
-						if (timercmp(&current_time, &(head->timestamp), >)) {
-								/* If clock has passed timestamp of oldest packet: no wait */
-								timerclear(&timeout);
-						} else {
-								/* else: get remaining time to timeout */
-								timersub(&head->timestamp, &current_time, &timeout);
-						}
-						/* DEBUG */
-						snprintf(debug_buf, DEBUG_BUFSIZE,
-								 "Current time to timeout (sec): "YEL"%ld.%06ld"NRM"\n",
-								 timeout.tv_sec, timeout.tv_usec);
-						debugf(debug_buf);
-
-						/* Wait for ACK */
-						if (select(sockfd+1, &readfds, NULL, NULL, &timeout) == -1)
-								perror("select");
-						debug("Waiting for ACK\n");
-
-						if (FD_ISSET(sockfd, &readfds)) {
-								/* Packet received */
-								recv(sockfd, pkt_buffer, PKT_BUFSIZE, 0);
-								ack_pkt = get_packet_header(pkt_buffer);
-								printf("Seqnum of ACKs last received: "GRN"%d"NRM, ack_pkt->seqnum_last_recv);
-								printf(", seqnum oldest unacked packet: "GRN"%d"NRM"\n", head->pkt->seqnum);
-
-								/* Check: seqnum of ACK's last recv = seqnum of oldest pkt */
-								if (ACK == ack_pkt->flag && ack_pkt->seqnum_last_recv == head->pkt->seqnum) {
-										/* Oldest packet has been ack'ed */
-										debug("Received ACK");             /* DEBUG */
-										debug_print_packet_meta(ack_pkt);  /* DEBUG */
-										seqnum_last_recv = ack_pkt->seqnum;
-
-										/* Remove oldest pkt from list */
-										remove_head(&head);
-
-										/* Add new packet to list (if more files to send)
-										 * and send new packet.
-										 */
-										if (file_arr.files[file_idx])
-												/* if (file_idx < files_to_send) */ {
-												pkt = prep_packet(DATA,
-																  seqnum,
-																  seqnum_last_recv,
-																  file_arr.files[file_idx],
-																  payload_identifier);
-												add_node(&head, pkt);
-												printf("Packet seqnum: %d\n", pkt->seqnum);
-												payload_identifier++;
-												seqnum = (seqnum + 1) % max_no_seqnums;
-												file_idx++;
-
-												/* Sending the last packet added */
-												for(n = head; n->next != NULL; n = n->next) {;}
-												wc = load_and_send_packet(n->pkt,
-																		  pkt_buffer,
-																		  sockfd,
-																		  addr_ptr->ai_addr,
-																		  addr_ptr->ai_addrlen);
-										}
-								} else if (!(valid_packet(ack_pkt))) {
-										fprintf(stderr, RED "Warning:" NRM " received unknown packet.\n");
-								}
-								free_packet(ack_pkt); ack_pkt = NULL;
-						} else {
-								printf("- Timeout -\n");
-								break; /* Go to outer loop to resend window */
-						}
-				}
-		}
+		/* Sending packets to server */
+		if (snd.selective_repeat)
+				run_selective_repeat(&snd);
+		else
+				run_go_back_n(&snd);
 
 		/* Send TERM-packet */
 		printf("Terminating connection.\n");
-		pkt = prep_packet(TERM, seqnum, 0, NULL, 0);
-		wc = load_and_send_packet(pkt, pkt_buffer, sockfd,
-								  addr_ptr->ai_addr, addr_ptr->ai_addrlen);
+		pkt = prep_packet(TERM, snd.seqnum, 0, snd.window, NULL, 0, 0);
+		load_and_send_packet(pkt, snd.pkt_buffer, sockfd,
+							 addr_ptr->ai_addr, addr_ptr->ai_addrlen);
 		free_packet(pkt);
 
+		printf("Timeouts: %lu, retransmitted packets: %lu, srtt: %ld us, rttvar: %ld us, rto: %ld us\n",
+			   snd.timeouts, snd.retransmissions, snd.rtt.srtt, snd.rtt.rttvar, rtt_rto(&snd.rtt));
+		printf("Congestion window: %u (max %u), ssthresh: %u, loss events: %lu\n",
+			   cwnd_get(&snd.cw), snd.cw.max_cwnd, snd.cw.ssthresh, snd.cw.losses);
+		printf("Files loaded: %d, at most %d files (%ld bytes) in memory at once.\n",
+			   snd.payload_identifier, snd.max_loaded, snd.max_bytes);
+		if (snd.send_p5)
+				printf("Converted to P5: %ld bytes -> %ld bytes.\n", snd.bytes_before, snd.bytes_after);
+
 		/* Cleanup */
+		while ((qf = snd.files)) {
+				snd.files = qf->next;
+				free_file(qf->f);
+				free(qf);
+		}
 		free_string_array(&filenames);
-		free_file_array(&file_arr);
 		freeaddrinfo(addrs);
 		if (SUCCESS != close(sockfd))
 				perror("Error closing socket");
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "files.h"
+#include "mpmc_queue.h"
+#include "scan_pool.h"
+#include "image_index.h"
+#include "ref_buckets.h"
+#include "rcu.h"
+#include "ref_set.h"
+#include "compare_pool.h"
+
+
+/* Returns first reference image in snapshot set matching f, or NULL */
+static struct file *find_reference(struct references *refs, struct ref_set *set, struct file *f)
+{
+		struct ref_bucket *bucket;
+		const char *error;
+		int width, height;
+
+		__atomic_add_fetch(&refs->lookups, 1, __ATOMIC_RELAXED);
+		if (SUCCESS != file_dimensions(f, &width, &height, &error)) {
+				fprintf(stderr, RED "Warning:" NRM " %s is malformed: %s.\n", f->filename, error);
+				return NULL;
+		}
+		bucket = ref_buckets_find(&set->buckets, width, height);
+		if (NULL == bucket) {
+				__atomic_add_fetch(&refs->header_rejects, 1, __ATOMIC_RELAXED);
+				debug("No reference image with these dimensions");
+				return NULL;
+		}
+		if (set->indexed)
+				return image_index_find(&set->index, &set->fa, f);
+		/* First match in bucket is first match in fa: bucket keeps fa's order */
+		return scan_pool_find(refs->scan, &bucket->refs, f);
+}
+
+char *compare_result_line(struct references *refs, struct file *f)
+{
+		struct file *matching_file;
+		char *line;
+		int token;
+		/* Snapshot (and matching file in it) is not freed before read section ends */
+		token = rcu_read_lock(&refs->set);
+		matching_file = find_reference(refs, rcu_read(&refs->set), f);
+		if (matching_file) {
+				line = concat_strings_nl(f->filename, matching_file->filename);
+		} else {
+				debug("No matching image!");
+				line = concat_strings_nl(f->filename, "UNKOWN");
+		}
+		rcu_read_unlock(&refs->set, token);
+		return line;
+}
+
+/* Wait on semaphore, restarting if interrupted by a signal */
+static void wait_sem(sem_t *sem)
+{
+		while (-1 == sem_wait(sem) && EINTR == errno)
+				;
+}
+
+/* Stores compared job, and writes every result which is now in order
+ * (this one, and any waiting for it). Frees the jobs written.
+ */
+static void write_in_order(struct compare_pool *pool, struct compare_job *job)
+{
+		int waiting;
+		pthread_mutex_lock(&pool->out_lock);
+		pool->done[job->ticket % COMPARE_QUEUE_SIZE] = job;
+		waiting = (int) (job->ticket - pool->next_out);
+		if (waiting > pool->max_waiting)
+				pool->max_waiting = waiting;
+
+		/* The slot of next_out can only hold ticket next_out:
+		 * no ticket COMPARE_QUEUE_SIZE further is given out before it is written.
+		 */
+		while ((job = pool->done[pool->next_out % COMPARE_QUEUE_SIZE])) {
+				write_to_file(job->line, pool->output_fd);
+				pool->done[pool->next_out % COMPARE_QUEUE_SIZE] = NULL;
+				pool->next_out++;
+				pool->compared++;
+				free(job->line);
+				free(job);
+				sem_post(&pool->space);
+		}
+		/* Flushed, since the server runs until stopped */
+		fflush(pool->output_fd);
+		pthread_mutex_unlock(&pool->out_lock);
+}
+
+/* Takes a job from queue for a thread woken by items. Returns NULL if the
+ * pool is stopped and the queue is empty (the thread was woken to leave).
+ */
+static struct compare_job *take_job(struct compare_pool *pool)
+{
+		void *item;
+		/* The wake-up belongs to a job, unless the pool is stopping: it must not be lost.
+		 * Another producer may have claimed an earlier position in the queue,
+		 * and not have published its job quite yet.
+		 */
+		while (!queue_pop(&pool->jobs, &item)) {
+				if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE) && queue_empty(&pool->jobs))
+						return NULL;
+				sched_yield();
+		}
+		return item;
+}
+
+/* Compare thread: takes jobs from queue until pool is stopped and the queue is empty */
+static void *compare_thread(void *arg)
+{
+		struct compare_pool *pool;
+		struct compare_job *job;
+
+		pool = arg;
+		for (;;) {
+				wait_sem(&pool->items);
+				job = take_job(pool);
+				if (NULL == job)
+						break;
+				job->line = compare_result_line(pool->refs, job->f);
+				free_file(job->f);
+				job->f = NULL;
+				write_in_order(pool, job);
+		}
+		return NULL;
+}
+
+int compare_pool_start(struct compare_pool *pool, struct references *refs, FILE *output_fd, int n_threads)
+{
+		int i;
+
+		pool->refs = refs;
+		pool->output_fd = output_fd;
+		pool->next_ticket = 0;
+		pool->stopping = false;
+		pool->next_out = 0;
+		pool->compared = 0;
+		pool->max_waiting = 0;
+		for (i = 0; i < COMPARE_QUEUE_SIZE; i++)
+				pool->done[i] = NULL;
+
+		if (SUCCESS != queue_init(&pool->jobs, COMPARE_QUEUE_SIZE))
+				return FAILURE;
+		pool->threads = malloc(n_threads * sizeof(pthread_t));
+		if (NULL == pool->threads) {
+				perror("compare_pool_start: malloc");
+				queue_free(&pool->jobs);
+				return FAILURE;
+		}
+		sem_init(&pool->items, 0, 0);
+		sem_init(&pool->space, 0, COMPARE_QUEUE_SIZE);
+		pthread_mutex_init(&pool->out_lock, NULL);
+
+		pool->n_threads = 0;
+		for (i = 0; i < n_threads; i++) {
+				if (0 != pthread_create(&pool->threads[i], NULL, compare_thread, pool)) {
+						fprintf(stderr, "Error in compare_pool_start: could not start thread %d.\n", i);
+						break;
+				}
+				pool->n_threads++;
+		}
+		if (0 == pool->n_threads) {
+				compare_pool_stop(pool);
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+void compare_pool_submit(struct compare_pool *pool, struct file *f)
+{
+		struct compare_job *job;
+
+		/* Wait for a free ticket (result slot) */
+		wait_sem(&pool->space);
+		job = malloc(sizeof(struct compare_job));
+		if (NULL == job) {
+				perror("compare_pool_submit: malloc");
+				free_file(f);
+				sem_post(&pool->space);
+				return;
+		}
+		job->ticket = __atomic_fetch_add(&pool->next_ticket, 1, __ATOMIC_RELAXED);
+		job->f = f;
+		job->line = NULL;
+
+		/* There is always room for a ticket holder,
+		 * but a compare thread may not have handed its slot back quite yet.
+		 */
+		while (!queue_push(&pool->jobs, job))
+				sched_yield();
+		sem_post(&pool->items);
+}
+
+void compare_pool_stop(struct compare_pool *pool)
+{
+		int i;
+
+		/* Wake every thread once more: they leave when queue is empty */
+		__atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+		for (i = 0; i < pool->n_threads; i++)
+				sem_post(&pool->items);
+		for (i = 0; i < pool->n_threads; i++)
+				pthread_join(pool->threads[i], NULL);
+
+		if (pool->n_threads > 0)
+				printf("Compare pool: %lu files compared by %d threads (at most %d results waited for an earlier one)\n",
+					   pool->compared, pool->n_threads, pool->max_waiting);
+
+		free(pool->threads);
+		pool->threads = NULL;
+		queue_free(&pool->jobs);
+		sem_destroy(&pool->items);
+		sem_destroy(&pool->space);
+		pthread_mutex_destroy(&pool->out_lock);
+}
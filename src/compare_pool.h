@@ -0,0 +1,131 @@
+#ifndef COMPARE_POOL_H
+#define COMPARE_POOL_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "files.h"
+#include "mpmc_queue.h"
+#include "scan_pool.h"
+#include "rcu.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Compare threads used unless another number is given (server option -c) */
+#define COMPARE_THREADS_DEFAULT 2
+
+/* Max number of compare threads */
+#define MAX_COMPARE_THREADS 64
+
+/* Max number of received files submitted but not yet written to output (power of two).
+ * Submitting more blocks until the oldest result is written.
+ */
+#define COMPARE_QUEUE_SIZE 256
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Reference images and the means of searching them.
+ * set:            current snapshot of reference images (struct ref_set, see ref_set.h),
+ *                 with their buckets by dimensions and content hash index (if any).
+ *                 Files with dimensions of no bucket are rejected from their header,
+ *                 and otherwise only their bucket is searched (or the index).
+ *                 Replaced when reference images change, while lookups use the old one.
+ * scan:           scan threads helping search bucket (NULL: searched by one thread). Not used with index.
+ * lookups:        number of files looked up (atomic).
+ * header_rejects: number of them rejected from their header, without decoding (atomic).
+ */
+struct references {
+		struct rcu_ptr set;
+		struct scan_pool *scan;
+		unsigned long lookups;
+		unsigned long header_rejects;
+};
+
+/* A received file waiting for (or done with) comparison.
+ * ticket: position of file in output (order files were submitted in).
+ * f:      received file (freed when compared).
+ * line:   result line for output file (NULL until compared).
+ */
+struct compare_job {
+		unsigned long ticket;
+		struct file *f;
+		char *line;
+};
+
+/* Pool of threads comparing received files to the reference images,
+ * so the network threads never wait for a comparison.
+ * Files go through a lock-free queue to the compare threads.
+ * Results may finish in any order, but are written in submission order
+ * (for each client: payload id order).
+ *
+ * refs:        reference images (read only).
+ * output_fd:   file results are written to.
+ * n_threads:   number of compare threads.
+ * threads:     the compare threads.
+ * jobs:        submitted jobs not yet taken by a compare thread.
+ * items:       counts jobs in queue (compare threads wait on it).
+ * space:       counts free tickets (submit waits on it when COMPARE_QUEUE_SIZE are outstanding).
+ * next_ticket: ticket of next submitted file (atomic).
+ * stopping:    set when pool is stopped (threads exit once queue is empty).
+ * out_lock:    protects done, next_out and the counters below.
+ * done:        compared jobs waiting for the ones before them, by ticket % COMPARE_QUEUE_SIZE.
+ * next_out:    ticket of next result to be written.
+ * compared:    number of results written.
+ * max_waiting: most results ever waiting in done for an earlier one.
+ */
+struct compare_pool {
+		struct references *refs;
+		FILE *output_fd;
+		int n_threads;
+		pthread_t *threads;
+		struct mpmc_queue jobs;
+		sem_t items;
+		sem_t space;
+		unsigned long next_ticket;
+		bool stopping;
+		pthread_mutex_t out_lock;
+		struct compare_job *done[COMPARE_QUEUE_SIZE];
+		unsigned long next_out;
+		unsigned long compared;
+		int max_waiting;
+};
+
+
+/* ==============================
+ * ====== POOL FUNCTIONS ========
+ * ==============================
+ */
+
+/* Finds first reference image matching f (in current snapshot), and returns
+ * a malloced result line ("<filename> <matching filename or UNKOWN>\n").
+ * Only the bucket with the dimensions of f is searched (or the index, if any),
+ * and f is not decoded if there is no such bucket. Thread safe.
+ */
+char *compare_result_line(struct references *refs, struct file *f);
+
+/* Starts n_threads compare threads, which match files against refs
+ * and write results to output_fd.
+ * Returns SUCCESS, or FAILURE if the pool could not be set up.
+ */
+int compare_pool_start(struct compare_pool *pool, struct references *refs, FILE *output_fd, int n_threads);
+
+/* Hands received file f over to the pool (which frees it). Thread safe.
+ * Only blocks if COMPARE_QUEUE_SIZE files are already waiting for their result to be written.
+ */
+void compare_pool_submit(struct compare_pool *pool, struct file *f);
+
+/* Compares and writes all files submitted, then stops and joins the threads,
+ * and frees the pool. No files may be submitted after (or during) this call.
+ */
+void compare_pool_stop(struct compare_pool *pool);
+
+#endif /* COMPARE_POOL_H */
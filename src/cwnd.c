@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "rtt.h"
+#include "cwnd.h"
+
+
+/* Debug trace of window over time: "cwnd trace: <ms since start> <cwnd> <ssthresh>" */
+static void trace(struct congestion_window *cw)
+{
+		struct timespec current_time;
+		get_time(&current_time);
+		snprintf(debug_buf, DEBUG_BUFSIZE, "cwnd trace: %ld ms, cwnd: %u, ssthresh: %u\n",
+				 time_diff_us(&current_time, &cw->start) / 1000, cw->cwnd, cw->ssthresh); /* DEBUG */
+		debugf(debug_buf);  /* DEBUG */
+}
+
+void cwnd_init(struct congestion_window *cw, uint32_t limit)
+{
+		cw->cwnd = (CWND_INITIAL < limit) ? CWND_INITIAL : limit;
+		cw->ssthresh = limit;
+		cw->acked = 0;
+		cw->limit = limit;
+		cw->max_cwnd = cw->cwnd;
+		cw->losses = 0;
+		get_time(&cw->start);
+		trace(cw);
+}
+
+void cwnd_ack(struct congestion_window *cw)
+{
+		if (cw->cwnd >= cw->limit)
+				return;
+		if (cw->cwnd < cw->ssthresh) {
+				/* Slow start: window doubles every round trip */
+				cw->cwnd++;
+		} else if (++cw->acked >= cw->cwnd) {
+				/* Congestion avoidance: one more packet per round trip */
+				cw->acked = 0;
+				cw->cwnd++;
+		} else {
+				return;
+		}
+		if (cw->cwnd > cw->max_cwnd)
+				cw->max_cwnd = cw->cwnd;
+		trace(cw);
+}
+
+void cwnd_loss(struct congestion_window *cw, uint32_t in_flight)
+{
+		cw->ssthresh = in_flight / 2;
+		if (cw->ssthresh < CWND_MIN_SSTHRESH)
+				cw->ssthresh = CWND_MIN_SSTHRESH;
+		cw->cwnd = 1;
+		cw->acked = 0;
+		cw->losses++;
+		trace(cw);
+}
+
+uint32_t cwnd_get(struct congestion_window *cw)
+{
+		return cw->cwnd;
+}
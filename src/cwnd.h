@@ -0,0 +1,67 @@
+#ifndef CWND_H
+#define CWND_H
+
+#include <stdint.h>
+#include <time.h>
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Congestion window (packets) when sending starts */
+#define CWND_INITIAL 2
+
+/* Lower bound of slow start threshold after a loss (packets) */
+#define CWND_MIN_SSTHRESH 2
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Congestion window of the sender (RFC 5681, counted in packets instead of bytes).
+ * Slow start (cwnd + 1 per ACK) up to ssthresh, then additive increase
+ * (cwnd + 1 per window of ACKs). On loss ssthresh is set to half the packets
+ * in flight (multiplicative decrease) and cwnd restarts from 1.
+ *
+ * cwnd:      congestion window.
+ * ssthresh:  slow start threshold.
+ * acked:     packets ACKed since cwnd last grew (congestion avoidance).
+ * limit:     cwnd never grows past this (the sender's own window).
+ * max_cwnd:  largest cwnd reached (for statistics).
+ * losses:    number of loss events (for statistics).
+ * start:     time estimator was initialized (trace timestamps are relative to this).
+ */
+struct congestion_window {
+		uint32_t cwnd;
+		uint32_t ssthresh;
+		uint32_t acked;
+		uint32_t limit;
+		uint32_t max_cwnd;
+		unsigned long losses;
+		struct timespec start;
+};
+
+
+/* ===========================
+ * ====== CONGESTION WIN =====
+ * ===========================
+ */
+
+/* Set window to initial state (cwnd = CWND_INITIAL, slow start up to <limit>).
+ * limit is the most packets the sender will ever have in flight.
+ */
+void cwnd_init(struct congestion_window *cw, uint32_t limit);
+
+/* One packet (not previously ACKed) has been ACKed: grow window */
+void cwnd_ack(struct congestion_window *cw);
+
+/* Loss detected (timeout) with <in_flight> packets unACKed: shrink window */
+void cwnd_loss(struct congestion_window *cw, uint32_t in_flight);
+
+/* Returns current congestion window (packets) */
+uint32_t cwnd_get(struct congestion_window *cw);
+
+#endif /* CWND_H */
@@ -209,11 +209,12 @@ void print_addr(struct sockaddr_in *addr)
 
 void print_packet_meta(struct packet *p)
 {
-		printf("\n----------------- PACKET SEQ NUM " YEL "%d" NRM " -----------------\n", p->seqnum);
+		printf("\n----------------- PACKET SEQ NUM " YEL "%u" NRM " -----------------\n", ntohl(p->seqnum));
 		printf("-Field-            -Decimal-    -Hex-       -Binary-\n");
 		printf(" Packet length:        %4d     %4x\n", ntohl(p->len), ntohl(p->len));
-		printf(" Sequence number:      %4d     %4x\n", p->seqnum, p->seqnum);
-		printf(" Seq num last recv:    %4d     %4x\n", p->seqnum_last_recv, p->seqnum_last_recv);
+		printf(" Sequence number:      %4u     %4x\n", ntohl(p->seqnum), ntohl(p->seqnum));
+		printf(" Seq num last recv:    %4u     %4x\n", ntohl(p->seqnum_last_recv), ntohl(p->seqnum_last_recv));
+		printf(" Window:               %4u     %4x\n", ntohs(p->window), ntohs(p->window));
 		printf(" Flag:                          %4x       ", p->flag);
 		print_bits(p->flag);
 }
@@ -234,6 +235,8 @@ void print_payload_meta(struct payload *pl)
 				printf("-Field-       -Content-\n");
 				printf("id:           %8d\n", ntohl(pl->id));
 				printf("filename_len: %8d\n", ntohl(pl->filename_len));
+				printf("total_bytes:  %8d\n", ntohl(pl->total_bytes));
+				printf("offset:       %8d\n", ntohl(pl->offset));
 				printf("filename:     '%s'\n", pl->filename);
 		} else {
 				printf("\n[No payload]\n");
@@ -297,11 +300,11 @@ void print_node(struct node *n)
 		}
 		printf("\n--- NODE ---\n");
 		printf("Timestamp (sec):   " YEL "%10ld" NRM "\n", n->timestamp.tv_sec);
-		printf("Packet seqnum:     " YEL "%10d" NRM "\n", n->pkt->seqnum);
+		printf("Packet seqnum:     " YEL "%10u" NRM "\n", ntohl(n->pkt->seqnum));
 		if(n->pkt && n->pkt->pl)
 				printf("Payload identifier:" YEL "%10d" NRM "\n", ntohl(n->pkt->pl->id));
 		if (n->next)
-				printf("Next seqnum:       " YEL "%10d" NRM "\n", n->next->pkt->seqnum);
+				printf("Next seqnum:       " YEL "%10u" NRM "\n", ntohl(n->next->pkt->seqnum));
 		else
 				printf("Next seqnum:       %10s\n", "(null)");
 }
@@ -10,8 +10,10 @@
  * ==============================
  */
 
-/* Buffer required for printing formatted strings as debug messages */
-extern char debug_buf[];
+/* Buffer required for printing formatted strings as debug messages.
+ * Thread local, since server workers print debug messages concurrently.
+ */
+extern __thread char debug_buf[];
 extern int debug_mode;
 /* -------------------------
  * -------- GENERAL --------
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <libgen.h>
 #include <dirent.h>
 
@@ -13,6 +15,8 @@
 #include "my_constants.h"
 #include "debug_print.h"
 #include "pgmread.h"
+#include "image_cmp.h"
+#include "pgm.h"
 
 
 /* ================================
@@ -183,8 +187,14 @@ int read_strings_from_file(struct string_array *sa, char filename[])
 struct file *read_bytes_from_file(FILE *fd)
 {
 		struct file *f;
+		struct stat st;
 		int32_t filesize, rc;
 		char *read_bytes;
+		/* Modification time before reading: a file written while read is newer */
+		if (0 != fstat(fileno(fd), &st)) {
+				perror("Error in read_bytes_from_file, fstat");
+				return NULL;
+		}
 		/* Get file size */
 		filesize = get_filesize(fd);
 		snprintf(debug_buf, DEBUG_BUFSIZE, "Filesize is: %d\n", filesize);  /* DEBUG */
@@ -208,6 +218,11 @@ struct file *read_bytes_from_file(FILE *fd)
 		/* Set file struct pointers and size info */
 		f->n_bytes = filesize;
 		f->bytes = read_bytes;
+		f->img = NULL;
+		f->malformed = false;
+		f->mapped = false;
+		f->hashed = false;
+		f->mtime = st.st_mtim;
 		return f;
 }
 
@@ -248,6 +263,70 @@ struct file *get_file(char filename[])
 		return f;
 }
 
+struct file *map_file(char filename[])
+{
+		struct file *f;
+		struct stat st;
+		void *addr;
+		int fd;
+
+		snprintf(debug_buf, DEBUG_BUFSIZE, "Mapping file: %s\n", filename); /* DEBUG */
+		debugf(debug_buf);                                                 /* DEBUG */
+
+		fd = open(filename, O_RDONLY);
+		if (-1 == fd) {
+				fprintf(stderr, "Error when trying to open file called '%s':\n      ", filename);
+				perror("");
+				return NULL;
+		}
+		if (-1 == fstat(fd, &st)) {
+				perror("Error in map_file, fstat");
+				close(fd);
+				return NULL;
+		}
+		/* Nothing to map */
+		if (0 == st.st_size) {
+				close(fd);
+				return get_file(filename);
+		}
+		if (st.st_size > INT32_MAX) {
+				fprintf(stderr, "Error in map_file: %s is too large.\n", filename);
+				close(fd);
+				return NULL;
+		}
+		/* Mapping stays valid after fd is closed */
+		addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (MAP_FAILED == addr) {
+				perror("Error in map_file, mmap");
+				return NULL;
+		}
+		if (0 != madvise(addr, st.st_size, MADV_WILLNEED))
+				perror("map_file, madvise");
+
+		f = malloc(sizeof(struct file));
+		if (NULL == f) {
+				perror("Error during malloc in map_file");
+				munmap(addr, st.st_size);
+				return NULL;
+		}
+		f->filename = strdup(filename);
+		if (NULL == f->filename) {
+				perror("Error during strdup in map_file");
+				munmap(addr, st.st_size);
+				free(f);
+				return NULL;
+		}
+		f->n_bytes = (int32_t) st.st_size;
+		f->bytes = addr;
+		f->img = NULL;
+		f->malformed = false;
+		f->mapped = true;
+		f->hashed = false;
+		f->mtime = st.st_mtim;
+		return f;
+}
+
 int write_to_file(char *line, FILE *fd)
 {
 		int wc;
@@ -343,8 +422,59 @@ int add_filename(struct string_array *s, char filename[])
 
 int add_file_to_array(struct file_array *fa, char filename[])
 {
-		int res;
 		struct file *f;
+		f = get_file(filename);
+		if (NULL == f) {
+				fprintf(stderr, "Error in add_file_to_array\n");
+				return FAILURE;
+		}
+		if (FAILURE == append_file(fa, f)) {
+				free_file(f);
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+struct file *load_reference(char filename[], bool map)
+{
+		struct file *f;
+		struct Image *img;
+		if (!map)
+				f = get_file(filename);
+		else
+				f = map_file(filename);
+		if (NULL == f)
+				return NULL;
+		img = file_image(f);
+		if (NULL == img)
+				fprintf(stderr, RED "Warning:" NRM " could not decode %s.\n", filename);
+		/* Pixels of a P2 file are copied out when decoded, and the mapped bytes
+		 * are not read again: drop them from this process (they stay in the page cache).
+		 * Pixels of a P5 file are the mapping itself, so they are kept.
+		 */
+		if (f->mapped && img && !((struct pgm_image*) img)->borrowed)
+				madvise(f->bytes, f->n_bytes, MADV_DONTNEED);
+		return f;
+}
+
+int add_reference_to_array(struct file_array *fa, char filename[], bool map)
+{
+		struct file *f;
+		f = load_reference(filename, map);
+		if (NULL == f) {
+				fprintf(stderr, "Error in add_reference_to_array\n");
+				return FAILURE;
+		}
+		if (FAILURE == append_file(fa, f)) {
+				free_file(f);
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+int append_file(struct file_array *fa, struct file *f)
+{
+		int res;
 		/* If array is full, realloc */
 		if (fa->entries == fa->total_size) {
 				debug("Reallocating file_array");
@@ -352,47 +482,91 @@ int add_file_to_array(struct file_array *fa, char filename[])
 				if (FAILURE == res)
 						return FAILURE;
 		}
-		f = get_file(filename);
-		if (NULL == f) {
-				fprintf(stderr, "Error in add_file_to_array\n");
-				return FAILURE;
-		}
-
 		fa->files[fa->entries] = f;
 		fa->entries += 1;
+		return SUCCESS;
+}
+
+struct Image *decode_file(struct file *f)
+{
+		/* Decoded in place (Image_create needed a copy, as it changes the buffer) */
+		struct Image *img;
+		const char *error;
+		img = pgm_decode(f->bytes, f->n_bytes, &error);
+		if (NULL == img)
+				fprintf(stderr, RED "Warning:" NRM " %s is malformed: %s.\n", f->filename, error);
+		return img;
+}
+
+struct Image *file_image(struct file *f)
+{
+		if (NULL == f->img && !f->malformed) {
+				f->img = decode_file(f);
+				f->malformed = (NULL == f->img);
+		}
+		return f->img;
+}
 
+int file_dimensions(struct file *f, int *width, int *height, const char **error)
+{
+		struct pgm_header hdr;
+		if (f->img) {
+				*width = f->img->width;
+				*height = f->img->height;
+				return SUCCESS;
+		}
+		if (SUCCESS != pgm_parse_header(f->bytes, f->n_bytes, &hdr, error))
+				return FAILURE;
+		*width = hdr.width;
+		*height = hdr.height;
+		return SUCCESS;
+}
+
+int convert_to_p5(struct file *f)
+{
+		struct Image *img;
+		char *bytes;
+		size_t len;
+		img = file_image(f);
+		if (NULL == img)
+				return FAILURE;
+		bytes = pgm_encode_p5(img, PGM_MAXVAL, &len);
+		if (NULL == bytes) {
+				perror("convert_to_p5, malloc");
+				return FAILURE;
+		}
+		/* Image is decoded again (from the new bytes) when needed */
+		pgm_free(f->img);
+		f->img = NULL;
+		if (f->mapped)
+				munmap(f->bytes, f->n_bytes);
+		else
+				free(f->bytes);
+		f->bytes = bytes;
+		f->mapped = false;
+		f->n_bytes = (int) len;
 		return SUCCESS;
 }
 
 bool compare_files(struct file *f1, struct file *f2)
 {
-		/* Due to bug in Image_create, buffer must be copied before passed to Image_create */
-		int res;
 		struct Image *file1, *file2;
-		char *tmp_buf1, *tmp_buf2;
+		const char *error;
+		int width1, height1, width2, height2;
 		snprintf(debug_buf, DEBUG_BUFSIZE, "Comparing %25s    to %25s\n", f1->filename, f2->filename);   /* DEBUG */
 		debugf(debug_buf);  /* DEBUG */
 
-		/* Check if equal size */
-		if (f1->n_bytes != f2->n_bytes) {
-				debug("Images has different sizes!");
+		/* File sizes are not compared: formatting of equal images may differ.
+		 * Dimensions are, from the headers, so most files differing are never decoded.
+		 */
+		if (SUCCESS != file_dimensions(f1, &width1, &height1, &error)
+			|| SUCCESS != file_dimensions(f2, &width2, &height2, &error)
+			|| width1 != width2 || height1 != height2)
 				return false;
-		}
-
-		tmp_buf1 = malloc(f1->n_bytes * sizeof(char));
-		tmp_buf2 = malloc(f2->n_bytes * sizeof(char));
-		if (NULL == tmp_buf1 || NULL == tmp_buf2) {
-				fprintf(stderr, "Error during malloc, in compare_files.\n");
+		file1 = file_image(f1);
+		file2 = file_image(f2);
+		if (NULL == file1 || NULL == file2)
 				return false;
-		}
-
-		/* Copy buffer */
-		memcpy(tmp_buf1, f1->bytes, f1->n_bytes);
-		memcpy(tmp_buf2, f2->bytes, f2->n_bytes);
-		file1 = Image_create(tmp_buf1);
-		file2 = Image_create(tmp_buf2);
-		free(tmp_buf1);
-		free(tmp_buf2);
 
 		snprintf(debug_buf,
 				 DEBUG_BUFSIZE,
@@ -400,13 +574,8 @@ bool compare_files(struct file *f1, struct file *f2)
 				 file1->width, file1->height, file2->width, file2->height);   /* DEBUG */
 		debugf(debug_buf);  /* DEBUG */
 
-		res = 1;
-		res = Image_compare(file1, file2);
-		Image_free(file1);
-		Image_free(file2);
-
-		if (1 != res) return false;
-		return true;
+		/* Same result as Image_compare, with a vectorized pixel compare */
+		return images_equal(file1, file2);
 }
 
 struct file *compare_to_all_files(struct file_array *fa, struct file *f)
@@ -451,8 +620,14 @@ char *concat_strings_nl(char *line1, char *line2)
  */
 void free_file(struct file *f)
 {
+		/* Before bytes: pixels of a P5 image point into them */
+		if (f->img)
+				pgm_free(f->img);
 		free(f->filename);
-		free(f->bytes);
+		if (f->mapped)
+				munmap(f->bytes, f->n_bytes);
+		else
+				free(f->bytes);
 		free(f);
 }
 
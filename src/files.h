@@ -2,6 +2,11 @@
 #define FILES_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Decoded image (pgmread.h) */
+struct Image;
 
 /* ================================
  * ====== STRUCT DEFINITIONS ======
@@ -32,11 +37,25 @@ struct file_array {
 
 /* File struct, pointed to by file_array.files.
  * Contains 'n_bytes' number of raw bytes, and pointer to the raw bytes.
+ * img is the decoded image, kept once decoded (NULL until then, see file_image).
+ * malformed is set if decoding failed, so it is not tried again.
+ * mapped is true if bytes is a read-only memory map of the file (see map_file),
+ * false if bytes are malloced. bytes is NULL (n_bytes is still the file size)
+ * if only the image is loaded, from an index file (see index_file.h).
+ * hash is the content hash of img (see file_hash in image_index.h), if hashed is set.
+ * mtime is the modification time of the file, taken before its bytes were read or mapped
+ * (zero if it was not read from disk).
  */
 struct file {
 		int32_t n_bytes;
 		char *filename;
 		char *bytes;
+		struct Image *img;
+		bool malformed;
+		bool mapped;
+		bool hashed;
+		uint64_t hash;
+		struct timespec mtime;
 };
 
 
@@ -113,6 +132,14 @@ struct file *read_bytes_from_file(FILE *fd);
  */
 struct file *get_file(char filename[]);
 
+/* As get_file, but the file is memory mapped read-only instead of read:
+ * f->bytes points into the mapping (unmapped by free_file), and pages are read
+ * on first use and shared through the page cache by all processes mapping the file.
+ * The kernel is advised to read the file ahead (MADV_WILLNEED).
+ * The file must not be truncated while mapped. Empty files are read with get_file.
+ */
+struct file *map_file(char filename[]);
+
 /* Writes line to file */
 int write_to_file(char *line, FILE *fd);
 
@@ -154,16 +181,60 @@ int add_filename(struct string_array *s, char filename[]);
  */
 int add_file_to_array(struct file_array *fa, char filename[]);
 
+/* Reads (or if map is true, memory maps with map_file) a reference image,
+ * and decodes it at once (see file_image), so comparisons against it never decode it again.
+ * Files which can't be decoded are still returned (with a warning).
+ * Returns NULL if file can't be read. Thread safe (for different files).
+ */
+struct file *load_reference(char filename[], bool map);
+
+/* As add_file_to_array, but the file is loaded with load_reference.
+ * Used for reference images (server).
+ */
+int add_reference_to_array(struct file_array *fa, char filename[], bool map);
+
+/* Add an already created file-struct to file-array fa (the array takes over f).
+ * Calls realloc_byte_array if array is full.
+ * Prints error message and returns FAILURE on error.
+ */
+int append_file(struct file_array *fa, struct file *f);
+
 /* Compares two file-structs byte for byte.
  * Returns true if content of byte-array are identical
  * [TODO: implement]
  */
 /* bool compare_files(struct file*, struct file*); */
 
+/* Decodes PGM image in file f with pgm_decode (f is not changed).
+ * Returns the image (free with pgm_free), or NULL (with a warning) if f is malformed.
+ */
+struct Image *decode_file(struct file *f);
+
+/* Returns decoded image of f. Decoded with decode_file on first call,
+ * and kept in f->img (freed with f). NULL if f can't be decoded (only tried once).
+ * Not thread safe for a file which is not decoded (or tried) yet.
+ */
+struct Image *file_image(struct file *f);
+
+/* Gets dimensions of image in f without decoding it: from the PGM header
+ * (a few dozen bytes are parsed), or from f->img if f is decoded already.
+ * Returns SUCCESS, or FAILURE with *error set if the header is malformed.
+ */
+int file_dimensions(struct file *f, int *width, int *height, const char **error);
+
+/* Replaces bytes of f with the same image encoded as P5 (binary),
+ * which is smaller on the wire and decoded without parsing.
+ * Returns FAILURE (f is not changed) if f can't be decoded, or on malloc error.
+ */
+int convert_to_p5(struct file *f);
+
 /* Compare content of two file-structs and returns true if equal.
- * Internally this function uses Image_compare supplied by pgm.h
+ * Files with different dimensions (see file_dimensions) are rejected before decoding.
+ * Otherwise compares the decoded images (file_image) with images_equal (image_cmp.h),
+ * so each file is only decoded once.
+ * Files are equal if their pixels are, however the PGM file is formatted.
  */
-bool compare_images(struct file*, struct file*);
+bool compare_files(struct file*, struct file*);
 
 /* Uses compare_files to compare content of file-struct with
  * all entries in file_array-struct.
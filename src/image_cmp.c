@@ -0,0 +1,188 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pgmread.h"
+#include "image_cmp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+
+/* ===========================
+ * ========= KERNELS =========
+ * ===========================
+ */
+
+/* Portable kernel: 32 bytes (four words) per check, then the rest byte by byte */
+static bool pixels_equal_scalar(const unsigned char *a, const unsigned char *b, size_t n)
+{
+		uint64_t x[4], y[4];
+		size_t i;
+		for (i = 0; i + 32 <= n; i += 32) {
+				memcpy(x, a + i, 32);
+				memcpy(y, b + i, 32);
+				if (((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3])) != 0)
+						return false;
+		}
+		for (; i < n; i++)
+				if (a[i] != b[i])
+						return false;
+		return true;
+}
+
+#ifdef HAVE_X86_KERNELS
+/* SSE2 kernel: 64 bytes (four vectors) per check.
+ * The last bytes are covered by one vector ending at n (overlapping what is already compared).
+ */
+__attribute__((target("sse2")))
+static bool pixels_equal_sse2(const unsigned char *a, const unsigned char *b, size_t n)
+{
+		__m128i eq;
+		size_t i;
+		if (n < 16)
+				return pixels_equal_scalar(a, b, n);
+		for (i = 0; i + 64 <= n; i += 64) {
+				eq = _mm_and_si128(
+						_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)),
+													 _mm_loadu_si128((const __m128i*) (b + i))),
+									  _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i + 16)),
+													 _mm_loadu_si128((const __m128i*) (b + i + 16)))),
+						_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i + 32)),
+													 _mm_loadu_si128((const __m128i*) (b + i + 32))),
+									  _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i + 48)),
+													 _mm_loadu_si128((const __m128i*) (b + i + 48)))));
+				if (_mm_movemask_epi8(eq) != 0xffff)
+						return false;
+		}
+		for (; i + 16 <= n; i += 16) {
+				eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)),
+									_mm_loadu_si128((const __m128i*) (b + i)));
+				if (_mm_movemask_epi8(eq) != 0xffff)
+						return false;
+		}
+		if (i < n) {
+				eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + n - 16)),
+									_mm_loadu_si128((const __m128i*) (b + n - 16)));
+				if (_mm_movemask_epi8(eq) != 0xffff)
+						return false;
+		}
+		return true;
+}
+
+/* AVX2 kernel: 128 bytes (four vectors) per check, tail as in the SSE2 kernel */
+__attribute__((target("avx2")))
+static bool pixels_equal_avx2(const unsigned char *a, const unsigned char *b, size_t n)
+{
+		__m256i eq;
+		size_t i;
+		if (n < 32)
+				return pixels_equal_sse2(a, b, n);
+		for (i = 0; i + 128 <= n; i += 128) {
+				eq = _mm256_and_si256(
+						_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i)),
+														   _mm256_loadu_si256((const __m256i*) (b + i))),
+										 _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i + 32)),
+														   _mm256_loadu_si256((const __m256i*) (b + i + 32)))),
+						_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i + 64)),
+														   _mm256_loadu_si256((const __m256i*) (b + i + 64))),
+										 _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i + 96)),
+														   _mm256_loadu_si256((const __m256i*) (b + i + 96)))));
+				if (_mm256_movemask_epi8(eq) != -1)
+						return false;
+		}
+		for (; i + 32 <= n; i += 32) {
+				eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i)),
+									   _mm256_loadu_si256((const __m256i*) (b + i)));
+				if (_mm256_movemask_epi8(eq) != -1)
+						return false;
+		}
+		if (i < n) {
+				eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + n - 32)),
+									   _mm256_loadu_si256((const __m256i*) (b + n - 32)));
+				if (_mm256_movemask_epi8(eq) != -1)
+						return false;
+		}
+		return true;
+}
+#endif
+
+
+/* ============================
+ * ========= DISPATCH =========
+ * ============================
+ */
+
+/* Kernel chosen by choose_kernel (NULL until first call) */
+static pixel_kernel kernel = NULL;
+
+/* Picks fastest kernel the CPU supports.
+ * Threads may race on first call, but all store the same values.
+ */
+static pixel_kernel choose_kernel(void)
+{
+		pixel_kernel k;
+		k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+		if (k)
+				return k;
+		k = pixels_equal_scalar;
+#ifdef HAVE_X86_KERNELS
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+				k = pixels_equal_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+				k = pixels_equal_sse2;
+#endif
+		__atomic_store_n(&kernel, k, __ATOMIC_RELEASE);
+		return k;
+}
+
+bool pixels_equal(const unsigned char *a, const unsigned char *b, size_t n)
+{
+		return choose_kernel()(a, b, n);
+}
+
+const char *pixel_kernel_name(void)
+{
+		pixel_kernel k;
+		k = choose_kernel();
+#ifdef HAVE_X86_KERNELS
+		if (k == pixels_equal_avx2)
+				return "avx2";
+		if (k == pixels_equal_sse2)
+				return "sse2";
+#endif
+		(void) k;
+		return "scalar";
+}
+
+pixel_kernel get_pixel_kernel(const char *name)
+{
+		if (strcmp(name, "scalar") == 0)
+				return pixels_equal_scalar;
+#ifdef HAVE_X86_KERNELS
+		__builtin_cpu_init();
+		if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+				return pixels_equal_sse2;
+		if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+				return pixels_equal_avx2;
+#endif
+		return NULL;
+}
+
+
+/* ===========================
+ * ========= IMAGES ==========
+ * ===========================
+ */
+bool images_equal(struct Image *img1, struct Image *img2)
+{
+		if (img1->width != img2->width || img1->height != img2->height)
+				return false;
+		return pixels_equal((const unsigned char*) img1->data,
+							(const unsigned char*) img2->data,
+							(size_t) img1->width * img1->height);
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGE_CMP_H
+#define IMAGE_CMP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Decoded image (pgmread.h) */
+struct Image;
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Returns true if the n bytes at a and b are equal */
+typedef bool (*pixel_kernel)(const unsigned char *a, const unsigned char *b, size_t n);
+
+
+/* ===============================
+ * ====== COMPARE FUNCTIONS ======
+ * ===============================
+ */
+
+/* Returns true if img1 and img2 have the same dimensions and pixels.
+ * Same result as Image_compare, but pixels are compared with pixels_equal.
+ */
+bool images_equal(struct Image *img1, struct Image *img2);
+
+/* Returns true if the n pixels at a and b are equal.
+ * Uses the fastest kernel the CPU supports (AVX2, SSE2 or scalar),
+ * chosen at first call. Returns at the first block which differs.
+ */
+bool pixels_equal(const unsigned char *a, const unsigned char *b, size_t n);
+
+/* Name of kernel pixels_equal uses ("avx2", "sse2" or "scalar") */
+const char *pixel_kernel_name(void);
+
+/* Kernels, for benchmarks. Those the CPU does not support are NULL */
+pixel_kernel get_pixel_kernel(const char *name);
+
+#endif /* IMAGE_CMP_H */
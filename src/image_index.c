@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "files.h"
+#include "pgmread.h"
+#include "image_cmp.h"
+#include "image_index.h"
+
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+/* Continue FNV-1a hash h with n bytes from ptr */
+static uint64_t fnv1a(uint64_t h, const unsigned char *ptr, size_t n)
+{
+		size_t i;
+		for (i = 0; i < n; i++) {
+				h ^= ptr[i];
+				h *= FNV_PRIME;
+		}
+		return h;
+}
+
+uint64_t image_hash(struct Image *img)
+{
+		uint64_t h;
+		int32_t dims[2];
+		dims[0] = img->width;
+		dims[1] = img->height;
+		h = fnv1a(FNV_OFFSET, (unsigned char*) dims, sizeof dims);
+		return fnv1a(h, (unsigned char*) img->data, (size_t) img->width * img->height);
+}
+
+uint64_t file_hash(struct file *f)
+{
+		struct Image *img;
+		if (!f->hashed) {
+				img = file_image(f);
+				if (NULL == img)
+						return 0;
+				f->hash = image_hash(img);
+				f->hashed = true;
+		}
+		return f->hash;
+}
+
+/* Slot where probe sequence of hash starts */
+static uint32_t first_slot(struct image_index *idx, uint64_t hash)
+{
+		/* Low bits of FNV-1a are mixed less, fold the high half in */
+		return (uint32_t) (hash ^ (hash >> 32)) & idx->mask;
+}
+
+int image_index_build(struct image_index *idx, struct file_array *fa)
+{
+		uint64_t hash;
+		uint32_t n_slots, pos;
+		int i;
+
+		n_slots = 16;
+		while (n_slots < (uint32_t) fa->entries * INDEX_SLOTS_PER_IMAGE)
+				n_slots *= 2;
+		idx->slots = malloc(n_slots * sizeof(struct index_slot));
+		if (NULL == idx->slots) {
+				perror("image_index_build: malloc");
+				return FAILURE;
+		}
+		idx->n_slots = n_slots;
+		idx->mask = n_slots - 1;
+		idx->entries = 0;
+		for (pos = 0; pos < n_slots; pos++)
+				idx->slots[pos].file_idx = -1;
+
+		/* In file array order, so equal hashes are probed in that order */
+		for (i = 0; i < fa->entries; i++) {
+				if (NULL == fa->files[i])
+						continue;
+				if (NULL == file_image(fa->files[i]))
+						continue;
+				hash = file_hash(fa->files[i]);
+
+				pos = first_slot(idx, hash);
+				while (idx->slots[pos].file_idx != -1)
+						pos = (pos + 1) & idx->mask;
+				idx->slots[pos].hash = hash;
+				idx->slots[pos].file_idx = i;
+				idx->entries++;
+		}
+		printf("Indexed %d of %d reference images (%u slots).\n", idx->entries, fa->entries, idx->n_slots);
+		return SUCCESS;
+}
+
+struct file *image_index_find(struct image_index *idx, struct file_array *fa, struct file *f)
+{
+		struct Image *img, *ref;
+		struct index_slot *slot;
+		uint64_t hash;
+		uint32_t pos;
+
+		img = file_image(f);
+		if (NULL == img)
+				return NULL;
+		hash = image_hash(img);
+
+		/* Probe until an empty slot: every image with this hash is on the way */
+		for (pos = first_slot(idx, hash); idx->slots[pos].file_idx != -1; pos = (pos + 1) & idx->mask) {
+				slot = &idx->slots[pos];
+				if (slot->hash != hash)
+						continue;
+				/* Hash hit: verify pixel by pixel */
+				ref = file_image(fa->files[slot->file_idx]);
+				if (ref && images_equal(ref, img)) {
+						debug("Found equal file!");
+						return fa->files[slot->file_idx];
+				}
+				debug("Hash collision");
+		}
+		return NULL;
+}
+
+void image_index_free(struct image_index *idx)
+{
+		free(idx->slots);
+		idx->slots = NULL;
+		idx->entries = 0;
+}
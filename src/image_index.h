@@ -0,0 +1,79 @@
+#ifndef IMAGE_INDEX_H
+#define IMAGE_INDEX_H
+
+#include <stdint.h>
+
+#include "files.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Slots per indexed image (at least). Keeps probe sequences short,
+ * so a lookup of an unknown image usually ends at the first slot.
+ */
+#define INDEX_SLOTS_PER_IMAGE 2
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Slot of the index.
+ * hash:     content hash of reference image (see image_hash).
+ * file_idx: index of reference image in file array (-1 if slot is empty).
+ */
+struct index_slot {
+		uint64_t hash;
+		int file_idx;
+};
+
+/* Hash index of reference images by content (open addressing, linear probing).
+ * Images with equal hash are found in the order they were indexed,
+ * i.e. in file array order, so the first match is the same as compare_to_all_files.
+ *
+ * slots:   n_slots slots (power of two).
+ * mask:    n_slots - 1.
+ * entries: number of images indexed.
+ */
+struct image_index {
+		struct index_slot *slots;
+		uint32_t n_slots;
+		uint32_t mask;
+		int entries;
+};
+
+
+/* ==============================
+ * ====== INDEX FUNCTIONS =======
+ * ==============================
+ */
+
+/* Hash (64 bit FNV-1a) of dimensions and pixels of a decoded image.
+ * Depends only on the image content, not on whitespace or comments in the file.
+ */
+uint64_t image_hash(struct Image *img);
+
+/* Returns image_hash of decoded image of f, kept in f (see struct file),
+ * so it is only computed once. 0 if f can't be decoded.
+ * Not thread safe for a file which is not hashed yet.
+ */
+uint64_t file_hash(struct file *f);
+
+/* Hashes every (decoded, see file_image) image in fa, and indexes them.
+ * Images which can't be decoded are left out (they never match).
+ * Returns SUCCESS, or FAILURE on malloc error.
+ */
+int image_index_build(struct image_index *idx, struct file_array *fa);
+
+/* Looks up file f in index of fa. Candidates with equal hash are verified
+ * by comparing all pixels. Returns first matching file in fa, or NULL.
+ */
+struct file *image_index_find(struct image_index *idx, struct file_array *fa, struct file *f);
+
+/* Free slots of index */
+void image_index_free(struct image_index *idx);
+
+#endif /* IMAGE_INDEX_H */
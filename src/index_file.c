@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "my_constants.h"
+#include "files.h"
+#include "pgmread.h"
+#include "pgm.h"
+#include "image_index.h"
+#include "index_file.h"
+
+
+/* Hash (FNV-1a) of path, for the lookup table */
+static uint32_t path_hash(const char *path, size_t len)
+{
+		uint32_t h;
+		size_t i;
+		h = 2166136261U;
+		for (i = 0; i < len; i++) {
+				h ^= (unsigned char) path[i];
+				h *= 16777619U;
+		}
+		return h;
+}
+
+/* Checks that header and every record lie inside the mapping.
+ * Returns error message, or NULL if index file is valid.
+ */
+static const char *check_index_file(struct index_file *ix)
+{
+		struct index_file_header *hdr;
+		struct index_record *r;
+		uint64_t records_end;
+		uint32_t i;
+
+		if (ix->map_len < sizeof(struct index_file_header))
+				return "too short";
+		hdr = (struct index_file_header*) ix->map;
+		if (0 != memcmp(hdr->magic, INDEX_FILE_MAGIC, sizeof hdr->magic))
+				return "not an index file";
+		if (INDEX_FILE_VERSION != hdr->version)
+				return "other version";
+		records_end = sizeof(struct index_file_header) + (uint64_t) hdr->n_records * sizeof(struct index_record);
+		if (records_end > ix->map_len
+			|| hdr->strings_offset < records_end
+			|| hdr->strings_offset > ix->map_len
+			|| hdr->strings_len > ix->map_len - hdr->strings_offset)
+				return "truncated";
+		r = (struct index_record*) (ix->map + sizeof(struct index_file_header));
+		for (i = 0; i < hdr->n_records; i++) {
+				if ((uint64_t) r[i].path_offset + r[i].path_len > hdr->strings_len
+					|| r[i].width < 1 || r[i].height < 1
+					|| r[i].pixels_offset > ix->map_len
+					|| (uint64_t) r[i].width * r[i].height > ix->map_len - r[i].pixels_offset)
+						return "record out of bounds";
+		}
+		return NULL;
+}
+
+/* Unmaps index file, and forgets its records (used when it is not valid) */
+static void unmap_index_file(struct index_file *ix)
+{
+		if (ix->map)
+				munmap(ix->map, ix->map_len);
+		ix->map = NULL;
+		ix->map_len = 0;
+		ix->hdr = NULL;
+		ix->records = NULL;
+		ix->strings = NULL;
+}
+
+/* Fills path lookup table with the records of mapped index file */
+static int build_slots(struct index_file *ix)
+{
+		struct index_record *r;
+		uint32_t i, pos, n;
+
+		n = ix->hdr->n_records;
+		ix->n_slots = 16;
+		while (ix->n_slots < n * 2)
+				ix->n_slots *= 2;
+		ix->slots = malloc(ix->n_slots * sizeof(int32_t));
+		if (NULL == ix->slots) {
+				perror("index_file_open: malloc");
+				return FAILURE;
+		}
+		for (pos = 0; pos < ix->n_slots; pos++)
+				ix->slots[pos] = -1;
+		for (i = 0; i < n; i++) {
+				r = &ix->records[i];
+				pos = path_hash(ix->strings + r->path_offset, r->path_len) & (ix->n_slots - 1);
+				while (ix->slots[pos] != -1)
+						pos = (pos + 1) & (ix->n_slots - 1);
+				ix->slots[pos] = (int32_t) i;
+		}
+		return SUCCESS;
+}
+
+int index_file_open(struct index_file *ix, char path[])
+{
+		struct stat st;
+		const char *error;
+		void *addr;
+		int fd;
+
+		ix->path = path;
+		ix->map = NULL;
+		ix->map_len = 0;
+		ix->hdr = NULL;
+		ix->records = NULL;
+		ix->strings = NULL;
+		ix->n_slots = 0;
+		ix->slots = NULL;
+		ix->hits = 0;
+		ix->lookups = 0;
+
+		fd = open(path, O_RDONLY);
+		if (-1 == fd) {
+				if (ENOENT == errno)
+						printf("No index file %s, it is written when reference images are loaded.\n", path);
+				else
+						perror("index_file_open, open");
+				return SUCCESS;
+		}
+		if (-1 == fstat(fd, &st) || 0 == st.st_size) {
+				close(fd);
+				fprintf(stderr, RED "Warning:" NRM " index file %s is empty or can't be read, not used.\n", path);
+				return SUCCESS;
+		}
+		addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (MAP_FAILED == addr) {
+				perror("index_file_open, mmap");
+				return SUCCESS;
+		}
+		ix->map = addr;
+		ix->map_len = st.st_size;
+		if (NULL != (error = check_index_file(ix))) {
+				fprintf(stderr, RED "Warning:" NRM " index file %s is not valid (%s), not used.\n", path, error);
+				unmap_index_file(ix);
+				return SUCCESS;
+		}
+		ix->hdr = (struct index_file_header*) ix->map;
+		ix->records = (struct index_record*) (ix->map + sizeof(struct index_file_header));
+		ix->strings = ix->map + ix->hdr->strings_offset;
+		if (SUCCESS != build_slots(ix)) {
+				unmap_index_file(ix);
+				return FAILURE;
+		}
+		/* Only the pixels of images looked up are read, when used */
+		madvise(ix->map, ix->map_len, MADV_RANDOM);
+		return SUCCESS;
+}
+
+/* Returns record of path in index file, or NULL */
+static struct index_record *find_record(struct index_file *ix, const char *path)
+{
+		struct index_record *r;
+		size_t len;
+		uint32_t pos;
+
+		len = strlen(path);
+		pos = path_hash(path, len) & (ix->n_slots - 1);
+		for (; ix->slots[pos] != -1; pos = (pos + 1) & (ix->n_slots - 1)) {
+				r = &ix->records[ix->slots[pos]];
+				if (r->path_len == len && 0 == memcmp(ix->strings + r->path_offset, path, len))
+						return r;
+		}
+		return NULL;
+}
+
+struct file *index_file_lookup(struct index_file *ix, char filename[])
+{
+		struct index_record *r;
+		struct file *f;
+		struct stat st;
+
+		__atomic_add_fetch(&ix->lookups, 1, __ATOMIC_RELAXED);
+		if (NULL == ix->map)
+				return NULL;
+		r = find_record(ix, filename);
+		if (NULL == r)
+				return NULL;
+		if (0 != stat(filename, &st)
+			|| (uint64_t) st.st_size != r->size
+			|| st.st_mtim.tv_sec != r->mtime_sec
+			|| st.st_mtim.tv_nsec != r->mtime_nsec)
+				return NULL;
+
+		f = malloc(sizeof(struct file));
+		if (NULL == f) {
+				perror("index_file_lookup: malloc");
+				return NULL;
+		}
+		f->filename = strdup(filename);
+		f->img = pgm_wrap(r->width, r->height, (unsigned char*) ix->map + r->pixels_offset);
+		if (NULL == f->filename || NULL == f->img) {
+				perror("index_file_lookup: malloc");
+				free(f->filename);
+				pgm_free(f->img);
+				free(f);
+				return NULL;
+		}
+		f->n_bytes = (int32_t) r->size;
+		f->bytes = NULL;
+		f->malformed = false;
+		f->mapped = false;
+		f->hash = r->hash;
+		f->hashed = true;
+		f->mtime.tv_sec = r->mtime_sec;
+		f->mtime.tv_nsec = r->mtime_nsec;
+		__atomic_add_fetch(&ix->hits, 1, __ATOMIC_RELAXED);
+		return f;
+}
+
+bool index_file_stale(struct index_file *ix, struct file_array *fa)
+{
+		int i, decoded;
+		/* Files which can't be decoded are not in index file, and don't count */
+		decoded = 0;
+		for (i = 0; i < fa->entries; i++)
+				if (fa->files[i] && fa->files[i]->img)
+						decoded++;
+		if (NULL == ix->hdr)
+				return true;
+		return decoded != ix->hits || ix->hdr->n_records != (uint32_t) ix->hits;
+}
+
+/* Offset of pixels following a block ending at offset */
+static uint64_t align_pixels(uint64_t offset)
+{
+		return (offset + INDEX_FILE_ALIGN - 1) & ~(uint64_t) (INDEX_FILE_ALIGN - 1);
+}
+
+/* Writes n bytes of buf to fh. Returns SUCCESS, or FAILURE */
+static int write_all(FILE *fh, const void *buf, size_t n)
+{
+		if (n > 0 && 1 != fwrite(buf, n, 1, fh))
+				return FAILURE;
+		return SUCCESS;
+}
+
+/* Writes zeros to fh, up to offset (from pos). Returns SUCCESS, or FAILURE */
+static int write_padding(FILE *fh, uint64_t pos, uint64_t offset)
+{
+		static const char zeros[INDEX_FILE_ALIGN];
+		return write_all(fh, zeros, offset - pos);
+}
+
+int index_file_write(struct index_file *ix, struct file_array *fa)
+{
+		struct index_file_header hdr;
+		struct index_record *records;
+		struct file *f, **files;
+		char *tmp_path;
+		FILE *fh;
+		uint64_t pos;
+		uint32_t n, i;
+		int res, k;
+
+		records = calloc(fa->entries ? fa->entries : 1, sizeof(struct index_record));
+		files = calloc(fa->entries ? fa->entries : 1, sizeof(struct file*));
+		tmp_path = malloc(strlen(ix->path) + 5);
+		if (NULL == records || NULL == files || NULL == tmp_path) {
+				perror("index_file_write: malloc");
+				free(records);
+				free(files);
+				free(tmp_path);
+				return FAILURE;
+		}
+		strcpy(tmp_path, ix->path);
+		strcat(tmp_path, ".tmp");
+
+		/* Records of decodable images, in file array order. Size and mtime are the ones
+		 * taken when the file was loaded: a file changed since then no longer matches its record.
+		 */
+		n = 0;
+		pos = 0;
+		for (k = 0; k < fa->entries; k++) {
+				f = fa->files[k];
+				if (NULL == f || NULL == f->img)
+						continue;
+				files[n] = f;
+				records[n].size = f->n_bytes;
+				records[n].mtime_sec = f->mtime.tv_sec;
+				records[n].mtime_nsec = f->mtime.tv_nsec;
+				records[n].hash = file_hash(f);
+				records[n].width = f->img->width;
+				records[n].height = f->img->height;
+				records[n].path_offset = (uint32_t) pos;
+				records[n].path_len = (uint32_t) strlen(f->filename);
+				pos += records[n].path_len;
+				n++;
+		}
+		memset(&hdr, 0, sizeof hdr);
+		memcpy(hdr.magic, INDEX_FILE_MAGIC, sizeof hdr.magic);
+		hdr.version = INDEX_FILE_VERSION;
+		hdr.n_records = n;
+		hdr.strings_offset = sizeof hdr + (uint64_t) n * sizeof(struct index_record);
+		hdr.strings_len = pos;
+
+		/* Pixels follow strings */
+		pos = hdr.strings_offset + hdr.strings_len;
+		for (i = 0; i < n; i++) {
+				pos = align_pixels(pos);
+				records[i].pixels_offset = pos;
+				pos += (uint64_t) records[i].width * records[i].height;
+		}
+
+		fh = fopen(tmp_path, "wb");
+		if (NULL == fh) {
+				fprintf(stderr, "Error in index_file_write, %s: ", tmp_path);
+				perror("");
+				free(records);
+				free(files);
+				free(tmp_path);
+				return FAILURE;
+		}
+		res = write_all(fh, &hdr, sizeof hdr);
+		if (SUCCESS == res)
+				res = write_all(fh, records, n * sizeof(struct index_record));
+		for (i = 0; SUCCESS == res && i < n; i++)
+				res = write_all(fh, files[i]->filename, records[i].path_len);
+		pos = hdr.strings_offset + hdr.strings_len;
+		for (i = 0; SUCCESS == res && i < n; i++) {
+				res = write_padding(fh, pos, records[i].pixels_offset);
+				if (SUCCESS == res)
+						res = write_all(fh, files[i]->img->data, (size_t) records[i].width * records[i].height);
+				pos = records[i].pixels_offset + (uint64_t) records[i].width * records[i].height;
+		}
+		if (0 != fclose(fh))
+				res = FAILURE;
+
+		/* Replaces old index file, which stays valid where it is mapped */
+		if (SUCCESS == res && 0 != rename(tmp_path, ix->path))
+				res = FAILURE;
+		if (SUCCESS == res) {
+				printf("Wrote index file %s (%u images, %lu bytes).\n", ix->path, n, (unsigned long) pos);
+		} else {
+				fprintf(stderr, "Error in index_file_write, %s: ", ix->path);
+				perror("");
+				unlink(tmp_path);
+		}
+		free(records);
+		free(files);
+		free(tmp_path);
+		return res;
+}
+
+void index_file_close(struct index_file *ix)
+{
+		unmap_index_file(ix);
+		free(ix->slots);
+		ix->slots = NULL;
+		ix->n_slots = 0;
+}
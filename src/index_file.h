@@ -0,0 +1,118 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "files.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* First bytes of an index file, and its version (bumped when the layout changes) */
+#define INDEX_FILE_MAGIC "PGMINDEX"
+#define INDEX_FILE_VERSION 1
+
+/* Pixels of each image start at a multiple of this (offset in file) */
+#define INDEX_FILE_ALIGN 64
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Index file layout (host byte order, not meant to be moved between machines):
+ * header, n_records records, path strings (strings_len bytes), and then
+ * the pixels of each image (width * height bytes, aligned to INDEX_FILE_ALIGN).
+ */
+struct index_file_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t n_records;
+		uint64_t strings_offset;
+		uint64_t strings_len;
+};
+
+/* A reference image in index file.
+ * size, mtime_sec, mtime_nsec: size and modification time of the file when it was decoded.
+ * hash:                        content hash of image (image_hash).
+ * pixels_offset:               offset of pixels in index file.
+ * width, height:               dimensions of image.
+ * path_offset, path_len:       path of file (in strings, not 0-terminated).
+ */
+struct index_record {
+		uint64_t size;
+		int64_t mtime_sec;
+		int64_t mtime_nsec;
+		uint64_t hash;
+		uint64_t pixels_offset;
+		int32_t width;
+		int32_t height;
+		uint32_t path_offset;
+		uint32_t path_len;
+};
+
+/* Index file of a reference set, memory mapped read-only.
+ * Files unchanged since the index file was written (same size and mtime)
+ * are taken from it: pixels are used where they lie in the mapping,
+ * so they are not read, decoded or hashed again.
+ *
+ * path:     path of index file.
+ * map:      mapping of index file (NULL if there is none, or it is not valid).
+ * map_len:  length of mapping.
+ * records:  records in mapping.
+ * strings:  path strings in mapping.
+ * n_slots:  slots in path lookup table (power of two, 0 if no mapping).
+ * slots:    record index of each slot (-1 if slot is empty), by hash of path.
+ * hits:     files taken from index file.
+ * lookups:  files looked up.
+ */
+struct index_file {
+		char *path;
+		char *map;
+		size_t map_len;
+		struct index_file_header *hdr;
+		struct index_record *records;
+		const char *strings;
+		uint32_t n_slots;
+		int32_t *slots;
+		int hits;
+		int lookups;
+};
+
+
+/* ==================================
+ * ====== INDEX FILE FUNCTIONS ======
+ * ==================================
+ */
+
+/* Opens and maps index file at path. A missing or invalid index file is not an error:
+ * every file is then loaded from the reference directory (and the index file rewritten).
+ * Returns SUCCESS, or FAILURE on malloc error.
+ */
+int index_file_open(struct index_file *ix, char path[]);
+
+/* Returns reference image filename as a file struct with its image and hash
+ * taken from index file (bytes are not read, see struct file),
+ * or NULL if file is not in index file or has changed since. Thread safe.
+ */
+struct file *index_file_lookup(struct index_file *ix, char filename[]);
+
+/* True if index file does not hold exactly the (decodable) images in fa,
+ * all of them taken from it, and should be written again.
+ */
+bool index_file_stale(struct index_file *ix, struct file_array *fa);
+
+/* Writes index file of the decodable images in fa (to a temporary file,
+ * which then replaces the index file, so the old one stays valid while mapped).
+ * Returns SUCCESS, or FAILURE (with error message) if it could not be written.
+ */
+int index_file_write(struct index_file *ix, struct file_array *fa);
+
+/* Unmaps index file. Files taken from it must be freed first */
+void index_file_close(struct index_file *ix);
+
+#endif /* INDEX_FILE_H */
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "my_constants.h"
+#include "mpmc_queue.h"
+
+
+int queue_init(struct mpmc_queue *q, unsigned long capacity)
+{
+		unsigned long i;
+		if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+				fprintf(stderr, "queue_init: capacity must be a power of two.\n");
+				return FAILURE;
+		}
+		q->cells = malloc(capacity * sizeof(struct queue_cell));
+		if (NULL == q->cells) {
+				perror("queue_init: malloc");
+				return FAILURE;
+		}
+		for (i = 0; i < capacity; i++) {
+				q->cells[i].seq = i;
+				q->cells[i].item = NULL;
+		}
+		q->mask = capacity - 1;
+		q->head = 0;
+		q->tail = 0;
+		return SUCCESS;
+}
+
+bool queue_push(struct mpmc_queue *q, void *item)
+{
+		struct queue_cell *cell;
+		unsigned long pos, seq;
+		long diff;
+
+		pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		for (;;) {
+				cell = &q->cells[pos & q->mask];
+				seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+				diff = (long) (seq - pos);
+				if (0 == diff) {
+						/* Slot is free: claim position (pos is reloaded if another producer won) */
+						if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+														__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+								break;
+				} else if (diff < 0) {
+						/* Slot still holds item from one lap ago: full */
+						return false;
+				} else {
+						pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+				}
+		}
+		cell->item = item;
+		/* Publish item to consumers */
+		__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+		return true;
+}
+
+bool queue_pop(struct mpmc_queue *q, void **item)
+{
+		struct queue_cell *cell;
+		unsigned long pos, seq;
+		long diff;
+
+		pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		for (;;) {
+				cell = &q->cells[pos & q->mask];
+				seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+				diff = (long) (seq - (pos + 1));
+				if (0 == diff) {
+						if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+														__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+								break;
+				} else if (diff < 0) {
+						/* Nothing published at this position yet: empty */
+						return false;
+				} else {
+						pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+				}
+		}
+		*item = cell->item;
+		/* Hand slot back to producers, for position one lap ahead */
+		__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+		return true;
+}
+
+bool queue_empty(struct mpmc_queue *q)
+{
+		unsigned long head, tail;
+		head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		return head == tail;
+}
+
+void queue_free(struct mpmc_queue *q)
+{
+		free(q->cells);
+		q->cells = NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stdbool.h>
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Size of a cache line. Head and tail are kept apart,
+ * so producers and consumers don't invalidate each other's line.
+ */
+#define CACHE_LINE 64
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* One slot of the queue.
+ * seq:  position the slot is ready for (push when seq == pos, pop when seq == pos + 1).
+ * item: pointer stored in slot.
+ */
+struct queue_cell {
+		unsigned long seq;
+		void *item;
+};
+
+/* Bounded lock-free queue of pointers, for any number of producers and consumers
+ * (Vyukov's bounded MPMC queue). Only accessed with atomic builtins.
+ * Does not block: use semaphores (or similar) around it to wait for items or room.
+ *
+ * cells: capacity slots (capacity is a power of two).
+ * mask:  capacity - 1.
+ * head:  position of next pop.
+ * tail:  position of next push.
+ */
+struct mpmc_queue {
+		struct queue_cell *cells;
+		unsigned long mask;
+		char pad0[CACHE_LINE];
+		unsigned long head;
+		char pad1[CACHE_LINE];
+		unsigned long tail;
+		char pad2[CACHE_LINE];
+};
+
+
+/* ==============================
+ * ====== QUEUE FUNCTIONS =======
+ * ==============================
+ */
+
+/* Allocate an empty queue with room for capacity items (must be a power of two).
+ * Returns SUCCESS, or FAILURE if capacity is invalid or malloc fails.
+ */
+int queue_init(struct mpmc_queue *q, unsigned long capacity);
+
+/* Adds item to queue. Returns false (and does nothing) if the queue is full */
+bool queue_push(struct mpmc_queue *q, void *item);
+
+/* Removes oldest item from queue and stores it in *item.
+ * Returns false if the queue is empty.
+ */
+bool queue_pop(struct mpmc_queue *q, void **item);
+
+/* True if no item is in queue, or being pushed to it (every position claimed is popped).
+ * A pop may still fail while it is false, if the oldest push is not published yet.
+ */
+bool queue_empty(struct mpmc_queue *q);
+
+/* Free slots of queue (items left in it are not freed) */
+void queue_free(struct mpmc_queue *q);
+
+#endif /* MPMC_QUEUE_H */
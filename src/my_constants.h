@@ -14,6 +14,12 @@
 
 #define PKT_BUFSIZE 1430
 
-#define PKT_HEADER_SIZE 8
+/* Packet header: len, seqnum, seqnum_last_recv (4 bytes each),
+ * flag, unused (1 byte each) and window (2 bytes)
+ */
+#define PKT_HEADER_SIZE 16
+
+/* Payload header: id, filename_len, total_bytes and offset (4 bytes each) */
+#define PL_HEADER_SIZE 16
 
 #endif /* MY_CONSTANTS_H */
@@ -8,11 +8,14 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <netdb.h>
 
 #include "my_constants.h"
 #include "debug_print.h"
 #include "files.h"
 #include "send_packet.h"
+#include "rtt.h"
 #include "network.h"
 
 
@@ -46,11 +49,16 @@ struct packet *get_packet_header(char *buf)
 		struct packet *pkt;
 		ptr = buf;
 		pkt = malloc(sizeof(struct packet));
-		pkt->len = *(int32_t*)ptr; ptr += 4;
-		pkt->seqnum = *(uint8_t*)ptr++;
-		pkt->seqnum_last_recv = *(uint8_t*)ptr++;
+		if (NULL == pkt) {
+				perror("Error in get_packet_header during malloc");
+				return NULL;
+		}
+		memcpy(&pkt->len, ptr, 4); ptr += 4;
+		memcpy(&pkt->seqnum, ptr, 4); ptr += 4;
+		memcpy(&pkt->seqnum_last_recv, ptr, 4); ptr += 4;
 		pkt->flag = *(uint8_t*)ptr++;
 		pkt->unused = *(uint8_t*)ptr++;
+		memcpy(&pkt->window, ptr, 2);
 		pkt->pl = NULL;
 		if(!valid_packet(pkt)) {
 				free(pkt);
@@ -66,7 +74,8 @@ struct packet *get_packet_header(char *buf)
  * And therefore it needs to be passed the file-struct as argument (info on
  * file size is in the application layer, but is not part of the payload header).
  */
-struct packet *prep_packet(uint8_t type, int8_t seqnum, int8_t seqnum_last_recv, void *opt_data, int32_t pl_id)
+struct packet *prep_packet(uint8_t type, uint32_t seqnum, uint32_t seqnum_last_recv, uint16_t window,
+						   void *opt_data, int32_t pl_id, int32_t offset)
 {
 		struct packet *pkt;
 		struct payload *pl;
@@ -77,19 +86,26 @@ struct packet *prep_packet(uint8_t type, int8_t seqnum, int8_t seqnum_last_recv,
 				perror("Error in prep_packet during malloc");
 				return NULL;
 		}
-		pkt->seqnum = seqnum;
-		pkt->seqnum_last_recv = seqnum_last_recv;
+		pkt->seqnum = htonl(seqnum);
+		pkt->seqnum_last_recv = htonl(seqnum_last_recv);
 		pkt->flag = type;
 		pkt->unused = 0x7f;
+		pkt->window = htons(window);
 
 		if (DATA == type) {
 				f = (struct file*) opt_data;
-				pl = prep_payload(f, pl_id);
+				pl = prep_payload(f, pl_id, offset);
+				if (NULL == pl) {
+						free(pkt);
+						return NULL;
+				}
 				pkt->pl = pl;
 				fn_len = ntohl(pl->filename_len);
 
-				/* Number 8: Payload id (int) and int describing filename-len */
-				total_len = PKT_HEADER_SIZE + 8 + fn_len + f->n_bytes;
+				/* Payload header (id, filename-len, total bytes and offset),
+				 * filename and the bytes of this fragment.
+				 */
+				total_len = PKT_HEADER_SIZE + PL_HEADER_SIZE + fn_len + fragment_size(f, offset);
 				pkt->len = htonl(total_len);
 
 				snprintf(debug_buf, DEBUG_BUFSIZE, "in prep_packet, total_len: %d\n", total_len); /* DEBUG */
@@ -115,27 +131,51 @@ struct packet *prep_packet(uint8_t type, int8_t seqnum, int8_t seqnum_last_recv,
 		return pkt;
 }
 
-struct payload *prep_payload(struct file *f, int32_t pl_id)
+/* Returns pointer to basename (last part) of path, inside path itself */
+static char *basename_ptr(char *path)
+{
+		char *fn;
+		fn = strrchr(path, '/');
+		return fn ? fn + 1 : path;
+}
+
+int32_t fragment_size(struct file *f, int32_t offset)
+{
+		char *fn;
+		int32_t room, remaining;
+		/* Only basename is sent */
+		fn = basename_ptr(f->filename);
+		room = PKT_BUFSIZE - PKT_HEADER_SIZE - PL_HEADER_SIZE - (int32_t) (strlen(fn) + 1);
+		remaining = f->n_bytes - offset;
+		return (remaining < room) ? remaining : room;
+}
+
+struct payload *prep_payload(struct file *f, int32_t pl_id, int32_t offset)
 {
 		struct payload *pl;
-		char *fn, *bytes;
+		char *fn;
+		int32_t n_bytes;
+		n_bytes = fragment_size(f, offset);
+		if (n_bytes < 0) {
+				fprintf(stderr, "Error in prep_payload: filename of '%s' too long, or offset outside file.\n", f->filename);
+				return NULL;
+		}
 		pl = malloc(sizeof(struct payload));
-		bytes = malloc(sizeof(char) * f->n_bytes);
-		if (NULL == pl || NULL == bytes) {
+		if (NULL == pl) {
 				fprintf(stderr, RED "Critical error " NRM);
 				perror("in prep_payload during malloc");
 				return NULL;
 		}
-		/* Copy filename (memory allocated by get_basename)
-		 * and copy bytes from file-struct to malloced array.
+		/* Nothing is copied: filename points to basename in f->filename,
+		 * and bytes to the fragment's first byte in f->bytes.
 		 */
-		fn = get_basename(f->filename);
-		memcpy(bytes, f->bytes, f->n_bytes);
-		/* Set pointers accordingly */
+		fn = basename_ptr(f->filename);
 		pl->id = htonl(pl_id);
 		pl->filename_len = htonl(strlen(fn) + 1);
+		pl->total_bytes = htonl(f->n_bytes);
+		pl->offset = htonl(offset);
 		pl->filename = fn;
-		pl->bytes = bytes;
+		pl->bytes = f->bytes + offset;
 		return pl;
 }
 
@@ -160,8 +200,8 @@ int load_and_send_packet(struct packet *pkt, char *buf, int sockfd, struct socka
 				ptr = buf;
 				/* Copy packet header to buffer */
 				memcpy(ptr, pkt, PKT_HEADER_SIZE); ptr += PKT_HEADER_SIZE; remaining_bytes -= PKT_HEADER_SIZE;
-				/* Copy payload identifier and filename len to buffer*/
-				memcpy(ptr, pkt->pl, 8); ptr += 8; remaining_bytes -= 8;
+				/* Copy payload identifier, filename len, total bytes and offset to buffer */
+				memcpy(ptr, pkt->pl, PL_HEADER_SIZE); ptr += PL_HEADER_SIZE; remaining_bytes -= PL_HEADER_SIZE;
 				/* Copy filename (incl. '\0'-byte) to buffer */
 				memcpy(ptr, pkt->pl->filename, ntohl(pkt->pl->filename_len));
 				ptr += ntohl(pkt->pl->filename_len);
@@ -170,7 +210,6 @@ int load_and_send_packet(struct packet *pkt, char *buf, int sockfd, struct socka
 				memcpy(ptr, pkt->pl->bytes, remaining_bytes);
 				/* Send packet */
 				wc = send_packet(sockfd, buf, total_len, 0, dest_addr, addrlen);
-				memset(buf, 0, PKT_BUFSIZE);
 				if (-1 == wc)
 						return FAILURE;
 				snprintf(debug_buf, DEBUG_BUFSIZE, "In load_and_send_packets – Number of bytes sent: %ld\n", wc);
@@ -182,53 +221,213 @@ int load_and_send_packet(struct packet *pkt, char *buf, int sockfd, struct socka
 		return FAILURE;
 }
 
+int send_packet_iov(struct packet *pkt, int sockfd, struct sockaddr *dest_addr, socklen_t addrlen)
+{
+		struct iovec iov[4];
+		struct msghdr msg;
+		int32_t total_len, fn_len;
+		ssize_t wc;
+
+		total_len = ntohl(pkt->len);
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_name = dest_addr;
+		msg.msg_namelen = addrlen;
+		msg.msg_iov = iov;
+
+		/* Packet header is the first PKT_HEADER_SIZE bytes of the (packed) struct */
+		iov[0].iov_base = pkt;
+		iov[0].iov_len = PKT_HEADER_SIZE;
+		msg.msg_iovlen = 1;
+		if (DATA == pkt->flag) {
+				/* Payload header (first PL_HEADER_SIZE bytes of payload struct),
+				 * filename and fragment bytes, straight from the file struct.
+				 */
+				fn_len = ntohl(pkt->pl->filename_len);
+				iov[1].iov_base = pkt->pl;
+				iov[1].iov_len = PL_HEADER_SIZE;
+				iov[2].iov_base = pkt->pl->filename;
+				iov[2].iov_len = fn_len;
+				iov[3].iov_base = pkt->pl->bytes;
+				iov[3].iov_len = total_len - PKT_HEADER_SIZE - PL_HEADER_SIZE - fn_len;
+				msg.msg_iovlen = 4;
+		}
+		wc = sendmsg(sockfd, &msg, 0);
+		if (-1 == wc) {
+				perror("send_packet_iov, sendmsg");
+				return FAILURE;
+		}
+		snprintf(debug_buf, DEBUG_BUFSIZE, "In send_packet_iov – Number of bytes sent: %ld\n", wc); /* DEBUG */
+		debugf(debug_buf);  /* DEBUG */
+		return (int) wc;
+}
+
 
 /* --- SERVER SIDE --- */
-struct file *unpack_payload(char *pl_buf, int32_t payload_len)
-{
-		struct file *f;
-		int32_t remaining_bytes, id, filename_len;
-		char *ptr, *fn, *bytes;
 
-		debug("--- Unpacking payload ---");
+/* Bytes currently allocated to reassembly buffers (all sessions, all server workers).
+ * Shared between threads: only accessed with atomic builtins.
+ */
+static long reassembly_mem = 0;
+
+/* Fragment fields read from a payload buffer (host byte order) */
+struct fragment {
+		int32_t id;
+		int32_t filename_len;
+		int32_t total_bytes;
+		int32_t offset;
+		int32_t n_bytes;
+		char *filename;
+		char *bytes;
+};
+
+/* Parses payload header in pl_buf. Returns false if fields are inconsistent */
+static bool parse_fragment(char *pl_buf, int32_t payload_len, struct fragment *frag)
+{
+		char *ptr;
+		if (payload_len < PL_HEADER_SIZE)
+				return false;
 		ptr = pl_buf;
-		remaining_bytes = payload_len;
-		/* Consume payload identifier */
-		id = ntohl(*(uint32_t*)(ptr)); ptr += sizeof(int32_t); remaining_bytes -= 4;
+		frag->id = ntohl(*(int32_t*)(ptr)); ptr += 4;
+		frag->filename_len = ntohl(*(int32_t*)(ptr)); ptr += 4;
+		frag->total_bytes = ntohl(*(int32_t*)(ptr)); ptr += 4;
+		frag->offset = ntohl(*(int32_t*)(ptr)); ptr += 4;
+		/* Fields are checked before any arithmetic on them, so nothing can overflow */
+		if (frag->filename_len < 1 || frag->filename_len > payload_len - PL_HEADER_SIZE)
+				return false;
+		frag->filename = ptr;
+		frag->n_bytes = payload_len - PL_HEADER_SIZE - frag->filename_len;
+		frag->bytes = ptr + frag->filename_len;
+		if (frag->total_bytes < 0 || frag->total_bytes > MAX_FILE_SIZE)
+				return false;
+		if (frag->offset < 0 || frag->offset > frag->total_bytes
+			|| frag->n_bytes > frag->total_bytes - frag->offset)
+				return false;
+		return true;
+}
 
-		printf("Payload id: "YEL"%d"NRM"\n", id);
-		/* /\* DEBUG *\/ */
-		/* snprintf(debug_buf, DEBUG_BUFSIZE, "Payload identifier: " YEL "%3d" NRM "\n", id); */
-		/* debugf(debug_buf); */
+/* True if frag continues the file being reassembled, or starts a new file at offset 0.
+ * Fragments are sent and delivered in order: a repeated or overlapping fragment
+ * would count its bytes twice, and complete a file with bytes never received.
+ */
+static bool in_order(struct reassembly *r, struct fragment *frag)
+{
+		if (r->f && frag->id == r->id)
+				return frag->offset == r->received;
+		return 0 == frag->offset;
+}
 
-		snprintf(debug_buf, DEBUG_BUFSIZE, "w/total payload len: %4d\n", payload_len);  /* DEBUG */
-		debugf(debug_buf);  /* DEBUG */
+void init_reassembly(struct reassembly *r)
+{
+		r->id = -1;
+		r->received = 0;
+		r->f = NULL;
+}
 
-		f = malloc(sizeof(struct file));
-		if (NULL == f) {
-				perror("Error in unpack_payload during malloc (1)");
-				return NULL;
+void free_reassembly(struct reassembly *r)
+{
+		if (r->f) {
+				__atomic_sub_fetch(&reassembly_mem, r->f->n_bytes, __ATOMIC_RELAXED);
+				free_file(r->f);
+		}
+		init_reassembly(r);
+}
+
+bool can_reassemble(struct reassembly *r, char *pl_buf, int32_t payload_len)
+{
+		struct fragment frag;
+		long mem;
+		if (!parse_fragment(pl_buf, payload_len, &frag)) {
+				fprintf(stderr, RED "Warning:" NRM " malformed fragment (or file too big) received.\n");
+				return false;
+		}
+		if (!in_order(r, &frag)) {
+				fprintf(stderr, RED "Warning:" NRM " fragment of file %d at %d out of order, dropped.\n", frag.id, frag.offset);
+				return false;
+		}
+		/* Fragment of file already being reassembled: memory is already allocated */
+		if (r->f && frag.id == r->id)
+				return true;
+		mem = __atomic_load_n(&reassembly_mem, __ATOMIC_RELAXED);
+		if (mem + frag.total_bytes > REASSEMBLY_MEM_LIMIT) {
+				snprintf(debug_buf, DEBUG_BUFSIZE, "Reassembly memory full (%ld bytes), dropping fragment\n", mem); /* DEBUG */
+				debugf(debug_buf);  /* DEBUG */
+				return false;
 		}
-		/* Consume filename_len */
-		filename_len = ntohl(*(int32_t*)(ptr)); ptr += 4; remaining_bytes -= 4;
-		fn = malloc(filename_len * sizeof(char));   /* Filename buffer */
-		if (NULL == fn) {
-				perror("Error in unpack_payload during malloc (2)");
+		return true;
+}
+
+struct file *unpack_payload(struct reassembly *r, char *pl_buf, int32_t payload_len)
+{
+		struct fragment frag;
+		struct file *f;
+		char *fn, *bytes;
+
+		debug("--- Unpacking payload ---");
+		if (!parse_fragment(pl_buf, payload_len, &frag)) {
+				fprintf(stderr, RED "Warning:" NRM " malformed fragment in unpack_payload.\n");
 				return NULL;
 		}
-		/* Consume filename */
-		strncpy(fn, ptr, filename_len); ptr += filename_len; remaining_bytes -= filename_len;
-		fn[filename_len - 1] = '\0';  /* Ensure null-byte */
-		f->filename = fn;
-		/* Copy bytes and return struct */
-		f->n_bytes = remaining_bytes;
-		bytes = malloc(remaining_bytes * sizeof(char));
-		if (NULL == bytes) {
-				perror("Error in unpack_payload during malloc (3)");
+		if (!in_order(r, &frag)) {
+				fprintf(stderr, RED "Warning:" NRM " fragment out of order in unpack_payload.\n");
 				return NULL;
 		}
-		memcpy(bytes, ptr, remaining_bytes);
-		f->bytes = bytes;
+		printf("Payload id: "YEL"%d"NRM", fragment at %d (%d of %d bytes)\n",
+			   frag.id, frag.offset, frag.n_bytes, frag.total_bytes);
+
+		snprintf(debug_buf, DEBUG_BUFSIZE, "w/total payload len: %4d\n", payload_len);  /* DEBUG */
+		debugf(debug_buf);  /* DEBUG */
+
+		/* Start of new file: drop any unfinished file, and allocate room for whole file */
+		if (NULL == r->f || frag.id != r->id) {
+				if (r->f)
+						fprintf(stderr, RED "Warning:" NRM " file %d was not completed, discarding.\n", r->id);
+				free_reassembly(r);
+
+				f = malloc(sizeof(struct file));
+				if (NULL == f) {
+						perror("Error in unpack_payload during malloc (1)");
+						return NULL;
+				}
+				fn = malloc(frag.filename_len * sizeof(char));   /* Filename buffer */
+				if (NULL == fn) {
+						perror("Error in unpack_payload during malloc (2)");
+						free(f);
+						return NULL;
+				}
+				/* Consume filename */
+				strncpy(fn, frag.filename, frag.filename_len);
+				fn[frag.filename_len - 1] = '\0';  /* Ensure null-byte */
+				f->filename = fn;
+				f->n_bytes = frag.total_bytes;
+				f->img = NULL;
+				f->malformed = false;
+				f->mapped = false;
+				f->hashed = false;
+				f->mtime.tv_sec = 0;
+				f->mtime.tv_nsec = 0;
+				bytes = malloc(frag.total_bytes ? frag.total_bytes : 1);
+				if (NULL == bytes) {
+						perror("Error in unpack_payload during malloc (3)");
+						free(fn);
+						free(f);
+						return NULL;
+				}
+				f->bytes = bytes;
+				r->f = f;
+				r->id = frag.id;
+				r->received = 0;
+				__atomic_add_fetch(&reassembly_mem, frag.total_bytes, __ATOMIC_RELAXED);
+		}
+		/* Copy bytes of fragment to their place in file */
+		memcpy(r->f->bytes + frag.offset, frag.bytes, frag.n_bytes);
+		r->received += frag.n_bytes;
+		if (r->received < r->f->n_bytes)
+				return NULL;
+
+		/* Complete: hand file over to caller */
+		f = r->f;
+		__atomic_sub_fetch(&reassembly_mem, f->n_bytes, __ATOMIC_RELAXED);
+		init_reassembly(r);
 		return f;
 }
 
@@ -241,21 +440,24 @@ void free_packet(struct packet *p)
 
 void free_payload(struct payload *pl)
 {
-		if (pl) {
-				free(pl->filename);
-				free(pl->bytes);
-				free(pl);
-		}
+		/* filename and bytes belong to the file struct */
+		free(pl);
 }
 
 
-bool already_received(uint8_t seqnum, uint8_t exp_seqnum, uint8_t window_size, uint8_t max_no_seqnums)
+/* Unsigned subtraction is done modulo 2^32, so the distances below
+ * are correct also when sequence numbers wrap around.
+ */
+bool already_received(uint32_t seqnum, uint32_t exp_seqnum, uint32_t window_size)
 {
-		for (uint8_t i = 1; i < (window_size + 1); i++) {
-				if ((seqnum + i) % max_no_seqnums == exp_seqnum)
-						return true;
-		}
-		return false;
+		uint32_t distance;
+		distance = exp_seqnum - seqnum;
+		return distance >= 1 && distance <= window_size;
+}
+
+bool in_window(uint32_t seqnum, uint32_t base, uint32_t window_size)
+{
+		return (uint32_t) (seqnum - base) < window_size;
 }
 
 /* =========================
@@ -265,21 +467,22 @@ bool already_received(uint8_t seqnum, uint8_t exp_seqnum, uint8_t window_size, u
 struct node *get_new_node(struct packet *pkt)
 {
 		struct node *ptr = malloc(sizeof(struct node));
-		int rv;
 		/* Set node vals/pointers */
 		if (!ptr) {
 				perror("get_new_node, malloc");
 				return ptr;
 		}
-		rv = gettimeofday(&(ptr->timestamp), NULL);
-		if (rv != 0)
-				perror("get_new_node, gettimeofday");
+		get_time(&ptr->timestamp);
+		ptr->sent_time = ptr->timestamp;
+		ptr->transmissions = 0;
+		ptr->sent_order = 0;
 		ptr->pkt = pkt;
+		ptr->acked = false;
 		ptr->next = NULL;
 		return ptr;
 }
 
-void add_node(struct node **list, struct packet *p)
+struct node *add_node(struct node **list, struct packet *p)
 {
 		struct node *n, *head;
 		head = *list;
@@ -291,7 +494,9 @@ void add_node(struct node **list, struct packet *p)
 				/* Go to end of list and add node */
 				for (n = head; n->next != NULL; n = n->next) {;}
 				n->next = get_new_node(p);
+				n = n->next;
 		}
+		return n;
 }
 
 void remove_head(struct node **list)
@@ -329,3 +534,24 @@ int listsize(struct node **list)
 				s++;
 		return s;
 }
+
+/* ==========================
+ * ======== ADDRESSES =======
+ * ==========================
+ */
+char *addr_to_string(struct sockaddr *addr, socklen_t addrlen, char *buf, size_t len)
+{
+		char host[NI_MAXHOST], port[NI_MAXSERV];
+		int rc;
+		rc = getnameinfo(addr, addrlen, host, sizeof(host), port, sizeof(port),
+						 NI_NUMERICHOST | NI_NUMERICSERV);
+		if (0 != rc) {
+				snprintf(buf, len, "(unknown: %s)", gai_strerror(rc));
+				return buf;
+		}
+		if (AF_INET6 == addr->sa_family)
+				snprintf(buf, len, "[%s]:%s", host, port);
+		else
+				snprintf(buf, len, "%s:%s", host, port);
+		return buf;
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 
@@ -17,7 +18,22 @@
 #define ACK  0x2
 #define TERM 0x4
 
-#define WINSIZE 7
+/* Window size (packets in flight) used unless another is given with -w */
+#define DEFAULT_WINSIZE 7
+
+/* Largest window a client may use or a server accepts.
+ * Sequence numbers are 32 bit and wrap around (serial number arithmetic),
+ * so the sequence number space is far larger than twice any window.
+ */
+#define MAX_WINSIZE 4096
+
+/* Max size of one file transferred (in bytes) */
+#define MAX_FILE_SIZE (64 * 1024 * 1024)
+
+/* Max number of bytes allocated to reassembly buffers, all sessions combined.
+ * First fragments of new files are dropped (not ACKed) while above this limit.
+ */
+#define REASSEMBLY_MEM_LIMIT (256 * 1024 * 1024)
 
 /* payload identifier used in application layer */
 extern int32_t pl_identifier;
@@ -34,14 +50,22 @@ extern int32_t pl_identifier;
  * In other words, each payload struct does *not* copy the referenced data,
  * but rather points to dynamic data structures (file structs).
  *
- * id:           unique number for each request.
+ * Files larger than one packet are split in fragments, one per DATA-packet.
+ * All fragments of a file have the same id, and each carries the filename.
+ * The first four fields (PL_HEADER_SIZE bytes) are sent as is (network byte order).
+ *
+ * id:           unique number for each request (file).
  * filename_len: length of filename in byte (including terminating 0).
+ * total_bytes:  size of whole file.
+ * offset:       position of this fragment's bytes in file.
  * filename:     C-string.
- * bytes:        bytes of images transferred.
+ * bytes:        bytes of images transferred (this fragment only).
  */
 struct payload {
 		int32_t id;
 		int32_t filename_len;
+		int32_t total_bytes;
+		int32_t offset;
 		char *filename;
 		char *bytes;
 }__attribute__((packed));
@@ -60,26 +84,53 @@ struct payload {
  *       0x2: 1 if packet contains an ACK (no payload).
  *       0x4: 1 if packet is terminating connection.
  * unused:           unused byte, should always be 0x7f
+ * window:           window size of sender of packet (client: packets it keeps in flight,
+ *                   server: packets the session accepts). 0 if unknown.
  * pl:               pointer to payload.
  */
 struct packet {
 		int32_t len;
-		uint8_t seqnum;
-		uint8_t seqnum_last_recv;
+		uint32_t seqnum;
+		uint32_t seqnum_last_recv;
 		uint8_t flag;
 		uint8_t unused;
+		uint16_t window;
 		struct payload* pl;
 }__attribute__((packed));
 
 
+/* Reassembly buffer for the file a client is currently sending (server side).
+ * Fragments must arrive in order, each at the offset where the previous one ended
+ * (others are rejected), so received counts every byte once.
+ *
+ * id:       payload id of file being reassembled (-1 if none).
+ * received: number of bytes received so far.
+ * f:        file being reassembled, with room for all its bytes (NULL if none).
+ */
+struct reassembly {
+		int32_t id;
+		int32_t received;
+		struct file *f;
+};
+
 /* Node for linked list.
- * timestamp is obtained with gettimeofday()
+ * Times are obtained from the monotonic clock (get_time in rtt.h).
+ * timestamp: set to the time the packet times out when it is sent.
+ * sent_time: time of first transmission (used for RTT samples).
+ * transmissions: number of times packet has been sent
+ *                (only packets sent once are RTT sampled, Karn's rule).
  * pkt: pointer to a packet.
+ * sent_order: order of latest transmission among all packets sent (set by sender).
+ * acked: packet has been ACKed individually (Selective Repeat).
  * next: pointer to next node (or NULL if tail)
  */
 struct node {
-		struct timeval timestamp;
+		struct timespec timestamp;
+		struct timespec sent_time;
+		int transmissions;
+		unsigned long sent_order;
 		struct packet *pkt;
+		bool acked;
 		struct node *next;
 };
 
@@ -91,33 +142,42 @@ struct node {
 bool valid_packet(struct packet *p);
 
 /* Returns a malloced packet struct with no payload-pointer (NULL).
- * If bytes in buf (from byte 0 to 7) is not a valid packet-header, NULL is returned.
+ * If bytes in buf (first PKT_HEADER_SIZE bytes) is not a valid packet-header, NULL is returned.
  */
 struct packet *get_packet_header(char *buf);
 
 
 /* Prepare a packet with the values given (see struct above for details),
- * and return pointer to this struct.
+ * and return pointer to this struct. Values are given in host byte order.
  * Handles ACK, TERM and DATA-type packets (macros defined at top of this header)
- * For ACK and TERM-packet, the opt_data and ()pl_id arguments are ignored.
+ * For ACK and TERM-packet, the opt_data, pl_id and offset arguments are ignored.
  * For DATA-packets, opt_data must be a pointer to a file struct, and payload-identifier
  * (pl_id) should be the next valid value for application layer to receive.
+ * The packet holds the fragment of the file starting at <offset>
+ * (as many bytes as fits, see fragment_size).
  */
 struct packet *prep_packet(uint8_t type,
-						   int8_t seqnum,
-						   int8_t seqnum_last_recv,
+						   uint32_t seqnum,
+						   uint32_t seqnum_last_recv,
+						   uint16_t window,
 						   void *opt_data,
-						   int32_t pl_id);
+						   int32_t pl_id,
+						   int32_t offset);
 
-/* Returns a pointer to a payload-struct
+/* Returns a pointer to a payload-struct with the fragment of f starting at offset
  * (See struct definition above for details).
+ * Filename and bytes are not copied: f must not be freed before the payload.
  * Is used by prep_packet internally.
  */
-struct payload *prep_payload(struct file *f, int32_t pl_id);
+struct payload *prep_payload(struct file *f, int32_t pl_id, int32_t offset);
+
+/* Returns number of bytes of file f, starting at offset,
+ * which fits in one packet (together with headers and filename).
+ */
+int32_t fragment_size(struct file *f, int32_t offset);
 
 /* Function loads packet passed as arg (prepared with above functions) to tmp buffer
- * and sends content of this buffer to address given.
- * Sets buffer <buf> to zero unless error occurs.
+ * and sends content of this buffer to address given (through lossy send_packet).
  * Does not modify or free any of the structs passed.
  */
 int load_and_send_packet(struct packet *pkt,
@@ -126,10 +186,34 @@ int load_and_send_packet(struct packet *pkt,
 						 struct sockaddr *dest_addr,
 						 socklen_t addrlen);
 
-/* Used server side to unpack payload (copy from buffer to data structs)
- * Returns pointer to dynamically allocated file struct.
+/* Sends packet with one sendmsg, gathered directly from the packet struct,
+ * payload struct, filename and file bytes (no copy to a buffer).
+ * Bypasses send_packet, so use load_and_send_packet when loss is emulated.
+ * Returns number of bytes sent, or FAILURE.
  */
-struct file *unpack_payload(char *pl_buf, int32_t payload_len);
+int send_packet_iov(struct packet *pkt,
+					int sockfd,
+					struct sockaddr *dest_addr,
+					socklen_t addrlen);
+
+/* Used server side to unpack payload (copy fragment from buffer to reassembly buffer r).
+ * Returns pointer to dynamically allocated file struct when all fragments
+ * of the file have arrived, NULL otherwise (or on error).
+ */
+struct file *unpack_payload(struct reassembly *r, char *pl_buf, int32_t payload_len);
+
+/* Returns false if a fragment (in pl_buf) cannot be reassembled right now,
+ * i.e. it is malformed, out of order (see struct reassembly), the file is too big,
+ * or it starts a new file while reassembly memory is above REASSEMBLY_MEM_LIMIT.
+ * Such packets should be dropped without ACK (client retransmits later).
+ */
+bool can_reassemble(struct reassembly *r, char *pl_buf, int32_t payload_len);
+
+/* Set reassembly buffer empty (must be done before first use) */
+void init_reassembly(struct reassembly *r);
+
+/* Free file being reassembled (if any) and set buffer empty */
+void free_reassembly(struct reassembly *r);
 
 /* Frees all malloced memory in packet struct,
  * including payload (if any) and the packet-ptr itself.
@@ -137,16 +221,22 @@ struct file *unpack_payload(char *pl_buf, int32_t payload_len);
  */
 void free_packet(struct packet*);
 
-/* Frees all malloced memory pointed to by the content of the payload struct.
- * Includes bytes, filename as well as the struct ptr itself
+/* Frees the payload struct.
+ * Filename and bytes point into a file struct, and are not freed.
  */
 void free_payload(struct payload*);
 
-/* Given the expected seqnum, window size and maximum number of seqnums,
- * check if received seqnum is within boundary of already received packets
- * (and thus should be reACKed upon reception)
+/* Given the expected seqnum and window size,
+ * check if received seqnum is within boundary of already received packets,
+ * i.e. one of the window_size seqnums before exp_seqnum
+ * (and thus should be reACKed upon reception). Handles wraparound.
  */
-bool already_received(uint8_t seqnum, uint8_t exp_seqnum, uint8_t window_size, uint8_t max_no_seqnums);
+bool already_received(uint32_t seqnum, uint32_t exp_seqnum, uint32_t window_size);
+
+/* Check if seqnum is inside the window starting at base (base included),
+ * i.e. one of the window_size seqnums from base and up. Handles wraparound.
+ */
+bool in_window(uint32_t seqnum, uint32_t base, uint32_t window_size);
 
 /* =========================
  * ====== LINKED LIST ======
@@ -163,8 +253,9 @@ struct node *get_new_node(struct packet *pkt);
 /* Adds a new node to the end of the linked list (FIFO).
  * list is a double pointer to the first node (head).
  * Uses get_new_node internally. Also handles empty lists.
+ * Returns pointer to the new node.
  */
-void add_node(struct node **list, struct packet *p);
+struct node *add_node(struct node **list, struct packet *p);
 
 /* Removes the head of the list supplied.
  * Frees the corresponding structs (pkts),
@@ -177,4 +268,14 @@ void delete_list(struct node **list);
 
 int listsize(struct node **list);
 
+/* ==========================
+ * ======== ADDRESSES =======
+ * ==========================
+ */
+
+/* Writes printable "address:port" of <addr> to buf (of size len).
+ * Works for both ipv4 and ipv6. Returns buf.
+ */
+char *addr_to_string(struct sockaddr *addr, socklen_t addrlen, char *buf, size_t len);
+
 #endif /* NETWORK_H */
@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "my_constants.h"
+#include "pgmread.h"
+#include "pgm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+
+/* Bytes classified per block */
+#define BLOCK 32
+
+static bool is_space(unsigned char c)
+{
+		return ' ' == c || (c >= '\t' && c <= '\r');
+}
+
+static bool is_digit(unsigned char c)
+{
+		return c >= '0' && c <= '9';
+}
+
+
+/* ================================
+ * ============ HEADER ============
+ * ================================
+ */
+
+/* Skips whitespace and comments (from '#' to end of line) from *pos */
+static void skip_space(const char *buf, size_t len, size_t *pos)
+{
+		while (*pos < len) {
+				if ('#' == buf[*pos]) {
+						while (*pos < len && buf[*pos] != '\n' && buf[*pos] != '\r')
+								(*pos)++;
+				} else if (is_space(buf[*pos])) {
+						(*pos)++;
+				} else {
+						return;
+				}
+		}
+}
+
+/* Reads a decimal number at *pos (after whitespace and comments).
+ * Returns it, or -1 if there is no number or it is above limit.
+ */
+static long read_number(const char *buf, size_t len, size_t *pos, long limit)
+{
+		long value;
+		skip_space(buf, len, pos);
+		if (*pos >= len || !is_digit(buf[*pos]))
+				return -1;
+		value = 0;
+		while (*pos < len && is_digit(buf[*pos])) {
+				value = value * 10 + (buf[*pos] - '0');
+				if (value > limit)
+						return -1;
+				(*pos)++;
+		}
+		return value;
+}
+
+int pgm_parse_header(const char *buf, size_t len, struct pgm_header *hdr, const char **error)
+{
+		size_t pos;
+		long width, height, maxval;
+
+		if (len < 2 || buf[0] != 'P' || (buf[1] != '2' && buf[1] != '5')) {
+				*error = "not a P2 or P5 image";
+				return FAILURE;
+		}
+		pos = 2;
+		if (pos < len && !is_space(buf[pos]) && buf[pos] != '#') {
+				*error = "no whitespace after magic number";
+				return FAILURE;
+		}
+		width = read_number(buf, len, &pos, PGM_MAX_DIM);
+		height = read_number(buf, len, &pos, PGM_MAX_DIM);
+		if (width < 1 || height < 1) {
+				*error = "invalid width or height";
+				return FAILURE;
+		}
+		maxval = read_number(buf, len, &pos, PGM_MAXVAL);
+		if (maxval < 1) {
+				*error = "invalid maxval (or above 255)";
+				return FAILURE;
+		}
+		/* A single whitespace character ends the header */
+		if (pos >= len || !is_space(buf[pos])) {
+				*error = "no whitespace after maxval";
+				return FAILURE;
+		}
+		hdr->format = buf[1] - '0';
+		hdr->width = (int) width;
+		hdr->height = (int) height;
+		hdr->maxval = (int) maxval;
+		hdr->raster = pos + 1;
+		return SUCCESS;
+}
+
+
+/* ================================
+ * ======== CLASSIFICATION ========
+ * ================================
+ */
+
+/* Sets bit i of *digits if p[i] is a digit, and of *spaces if p[i] is whitespace,
+ * for the BLOCK bytes at p.
+ */
+typedef void (*classify_kernel)(const char *p, uint32_t *digits, uint32_t *spaces);
+
+static void classify_scalar(const char *p, uint32_t *digits, uint32_t *spaces)
+{
+		int i;
+		*digits = 0;
+		*spaces = 0;
+		for (i = 0; i < BLOCK; i++) {
+				if (is_digit(p[i]))
+						*digits |= (uint32_t) 1 << i;
+				else if (is_space(p[i]))
+						*spaces |= (uint32_t) 1 << i;
+		}
+}
+
+#ifdef HAVE_X86_KERNELS
+/* '0' <= c <= '9' and (c == ' ' or '\t' <= c <= '\r'), with signed byte compares
+ * (bytes above 127 are negative, and neither digits nor whitespace).
+ */
+__attribute__((target("sse2")))
+static void classify_sse2(const char *p, uint32_t *digits, uint32_t *spaces)
+{
+		__m128i c, d, s;
+		int half;
+		*digits = 0;
+		*spaces = 0;
+		for (half = 0; half < 2; half++) {
+				c = _mm_loadu_si128((const __m128i*) (p + 16 * half));
+				d = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+								  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+				s = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+								 _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('\t' - 1)),
+											   _mm_cmplt_epi8(c, _mm_set1_epi8('\r' + 1))));
+				*digits |= (uint32_t) _mm_movemask_epi8(d) << (16 * half);
+				*spaces |= (uint32_t) _mm_movemask_epi8(s) << (16 * half);
+		}
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const char *p, uint32_t *digits, uint32_t *spaces)
+{
+		__m256i c, d, s;
+		c = _mm256_loadu_si256((const __m256i*) p);
+		d = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+							 _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+		s = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+							_mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('\t' - 1)),
+											 _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), c)));
+		*digits = (uint32_t) _mm256_movemask_epi8(d);
+		*spaces = (uint32_t) _mm256_movemask_epi8(s);
+}
+#endif
+
+/* Kernel chosen on first call (threads may race, but store the same value) */
+static classify_kernel classify = NULL;
+
+static classify_kernel choose_classify(void)
+{
+		classify_kernel k;
+		k = __atomic_load_n(&classify, __ATOMIC_ACQUIRE);
+		if (k)
+				return k;
+		k = classify_scalar;
+#ifdef HAVE_X86_KERNELS
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+				k = classify_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+				k = classify_sse2;
+#endif
+		__atomic_store_n(&classify, k, __ATOMIC_RELEASE);
+		return k;
+}
+
+
+/* ================================
+ * ============ RASTER ============
+ * ================================
+ */
+
+/* State of the pixel parser, carried from block to block.
+ * pixels:     where pixel values are stored (n_pixels of them).
+ * count:      pixels parsed so far.
+ * value:      value of number being parsed.
+ * in_number:  a number is being parsed (its digits may continue in next block).
+ * in_comment: inside a comment (until end of line).
+ * maxval:     largest value allowed.
+ * error:      description of malformed input (NULL if none).
+ */
+struct raster_parser {
+		unsigned char *pixels;
+		long n_pixels;
+		long count;
+		long value;
+		bool in_number;
+		bool in_comment;
+		long maxval;
+		const char *error;
+};
+
+/* Number ended: store it as next pixel */
+static void end_number(struct raster_parser *rp)
+{
+		rp->in_number = false;
+		if (rp->count < rp->n_pixels)
+				rp->pixels[rp->count] = (unsigned char) rp->value;
+		rp->count++;
+}
+
+/* Adds digit c to number being parsed (starts one if none).
+ * A value above maxval is an error, and is not grown further (it can't overflow).
+ */
+static void add_digit(struct raster_parser *rp, unsigned char c)
+{
+		if (!rp->in_number) {
+				rp->in_number = true;
+				rp->value = 0;
+		}
+		rp->value = rp->value * 10 + (c - '0');
+		if (rp->value > rp->maxval) {
+				rp->error = "pixel value above maxval";
+				rp->value = rp->maxval + 1;
+		}
+}
+
+/* Parses n bytes at p one by one (blocks with comments, and the tail) */
+static void parse_bytes(struct raster_parser *rp, const char *p, size_t n)
+{
+		size_t i;
+		unsigned char c;
+		for (i = 0; i < n && NULL == rp->error && rp->count < rp->n_pixels; i++) {
+				c = p[i];
+				if (rp->in_comment) {
+						if ('\n' == c || '\r' == c)
+								rp->in_comment = false;
+				} else if (is_digit(c)) {
+						add_digit(rp, c);
+				} else if (is_space(c)) {
+						if (rp->in_number)
+								end_number(rp);
+				} else if ('#' == c) {
+						if (rp->in_number)
+								end_number(rp);
+						rp->in_comment = true;
+				} else {
+						rp->error = "invalid character in pixel data";
+				}
+		}
+}
+
+/* Parses a block of only digits and whitespace (digits: bit i set if p[i] is a digit).
+ * Runs of digits are found from the mask, so whitespace is skipped without looking at it.
+ */
+static void parse_block(struct raster_parser *rp, const char *p, uint32_t digits)
+{
+		uint64_t mask;
+		int i, run, end;
+
+		mask = digits;
+		i = 0;
+		while (i < BLOCK && NULL == rp->error && rp->count < rp->n_pixels) {
+				if (!rp->in_number) {
+						/* Skip to next digit */
+						if (0 == (mask >> i))
+								return;
+						i += __builtin_ctzll(mask >> i);
+				}
+				/* Digits from i on (~ of shifted mask has a 1 at bit BLOCK - i at the latest) */
+				run = __builtin_ctzll(~(mask >> i));
+				for (end = i + run; i < end && NULL == rp->error; i++)
+						add_digit(rp, p[i]);
+				if (i < BLOCK && NULL == rp->error)
+						end_number(rp);
+		}
+}
+
+/* Returns a pgm_image of given dimensions, with data pointing at pixels
+ * (borrowed), or at width * height malloced bytes if pixels is NULL. NULL on malloc error.
+ */
+static struct pgm_image *new_image(int width, int height, const char *pixels)
+{
+		struct pgm_image *pi;
+		pi = malloc(sizeof(struct pgm_image));
+		if (NULL == pi)
+				return NULL;
+		pi->img.width = width;
+		pi->img.height = height;
+		pi->borrowed = (NULL != pixels);
+		if (pixels) {
+				pi->img.data = (void*) pixels;
+		} else {
+				pi->img.data = malloc((size_t) width * height);
+				if (NULL == pi->img.data) {
+						free(pi);
+						return NULL;
+				}
+		}
+		return pi;
+}
+
+struct Image *pgm_wrap(int width, int height, const unsigned char *pixels)
+{
+		struct pgm_image *pi;
+		pi = new_image(width, height, (const char*) pixels);
+		if (NULL == pi)
+				return NULL;
+		return &pi->img;
+}
+
+void pgm_free(struct Image *img)
+{
+		struct pgm_image *pi;
+		if (NULL == img)
+				return;
+		/* img is first member of its pgm_image */
+		pi = (struct pgm_image*) img;
+		if (!pi->borrowed)
+				free(img->data);
+		free(pi);
+}
+
+/* P5: header, then width * height bytes which are used as they are */
+static struct Image *decode_p5(const char *buf, size_t len, struct pgm_header *hdr, const char **error)
+{
+		struct pgm_image *pi;
+		size_t i, n;
+		n = (size_t) hdr->width * hdr->height;
+		if (len - hdr->raster < n) {
+				*error = "too few pixels";
+				return NULL;
+		}
+		/* Values above maxval are only looked for if maxval is not the largest possible */
+		if (hdr->maxval < PGM_MAXVAL) {
+				for (i = 0; i < n; i++) {
+						if ((unsigned char) buf[hdr->raster + i] > hdr->maxval) {
+								*error = "pixel value above maxval";
+								return NULL;
+						}
+				}
+		}
+		pi = new_image(hdr->width, hdr->height, buf + hdr->raster);
+		if (NULL == pi) {
+				*error = "out of memory";
+				return NULL;
+		}
+		return &pi->img;
+}
+
+struct Image *pgm_decode(const char *buf, size_t len, const char **error)
+{
+		struct pgm_header hdr;
+		struct raster_parser rp;
+		struct pgm_image *pi;
+		struct Image *img;
+		classify_kernel k;
+		const char *p, *end;
+		uint32_t digits, spaces;
+
+		if (SUCCESS != pgm_parse_header(buf, len, &hdr, error))
+				return NULL;
+		if (5 == hdr.format)
+				return decode_p5(buf, len, &hdr, error);
+
+		/* Every pixel takes at least two bytes (digit and whitespace) */
+		if ((long) hdr.width * hdr.height > (long) (len - hdr.raster + 1) / 2) {
+				*error = "too few pixels";
+				return NULL;
+		}
+		pi = new_image(hdr.width, hdr.height, NULL);
+		if (NULL == pi) {
+				*error = "out of memory";
+				return NULL;
+		}
+		img = &pi->img;
+		rp.pixels = (unsigned char*) img->data;
+		rp.n_pixels = (long) hdr.width * hdr.height;
+		rp.count = 0;
+		rp.value = 0;
+		rp.in_number = false;
+		rp.in_comment = false;
+		rp.maxval = hdr.maxval;
+		rp.error = NULL;
+
+		k = choose_classify();
+		p = buf + hdr.raster;
+		end = buf + len;
+		while (end - p >= BLOCK && NULL == rp.error && rp.count < rp.n_pixels) {
+				k(p, &digits, &spaces);
+				if ((digits | spaces) == 0xffffffffu && !rp.in_comment)
+						parse_block(&rp, p, digits);
+				else
+						parse_bytes(&rp, p, BLOCK);
+				p += BLOCK;
+		}
+		if (NULL == rp.error && rp.count < rp.n_pixels)
+				parse_bytes(&rp, p, end - p);
+		if (rp.in_number && NULL == rp.error)
+				end_number(&rp);
+
+		/* Anything after the last pixel is ignored */
+		if (NULL == rp.error && rp.count < rp.n_pixels)
+				rp.error = "too few pixels";
+		if (rp.error) {
+				*error = rp.error;
+				pgm_free(img);
+				return NULL;
+		}
+		return img;
+}
+
+char *pgm_encode_p5(struct Image *img, int maxval, size_t *len)
+{
+		char header[64];
+		char *buf;
+		size_t header_len, n;
+		header_len = (size_t) snprintf(header, sizeof header, "P5\n%d %d\n%d\n", img->width, img->height, maxval);
+		n = (size_t) img->width * img->height;
+		buf = malloc(header_len + n);
+		if (NULL == buf)
+				return NULL;
+		memcpy(buf, header, header_len);
+		memcpy(buf + header_len, img->data, n);
+		*len = header_len + n;
+		return buf;
+}
@@ -0,0 +1,86 @@
+#ifndef PGM_H
+#define PGM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "pgmread.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Largest maxval supported (one byte per pixel) */
+#define PGM_MAXVAL 255
+
+/* Largest width and height accepted */
+#define PGM_MAX_DIM 65535
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Header of a PGM image.
+ * format: 2 (P2, ASCII pixels) or 5 (P5, one byte per pixel).
+ * width, height: dimensions in pixels.
+ * maxval: largest pixel value (1 to PGM_MAXVAL).
+ * raster: offset in buffer of first byte after the header (pixel data).
+ */
+struct pgm_header {
+		int format;
+		int width;
+		int height;
+		int maxval;
+		size_t raster;
+};
+
+/* Image decoded by pgm_decode (free with pgm_free, not Image_free).
+ * img:      the image (width, height and one byte per pixel, as Image_create makes it).
+ * borrowed: img.data points into the decoded buffer (P5), and is not freed.
+ */
+struct pgm_image {
+		struct Image img;
+		bool borrowed;
+};
+
+
+/* ===========================
+ * ======== FUNCTIONS ========
+ * ===========================
+ */
+
+/* Parses header of PGM image in buf (len bytes, need not be 0-terminated).
+ * Handles comments and any whitespace between the fields.
+ * Returns SUCCESS, or FAILURE with *error set to a description of what is malformed.
+ */
+int pgm_parse_header(const char *buf, size_t len, struct pgm_header *hdr, const char **error);
+
+/* Decodes PGM image (P2 or P5) in buf (len bytes, need not be 0-terminated, is not changed).
+ * P2 pixels are parsed 32 bytes at a time: each block is classified into digits
+ * and whitespace with SIMD (AVX2 or SSE2, chosen at runtime), and only blocks with
+ * anything else (comments) take the byte by byte path.
+ * P5 is not copied: the image's data points into buf, which must outlive the image.
+ * Images of the same picture are equal (images_equal) whatever their format.
+ * Returns image (free with pgm_free), or NULL with *error set if buf is malformed:
+ * bad header, invalid characters, values above maxval or too few pixels.
+ */
+struct Image *pgm_decode(const char *buf, size_t len, const char **error);
+
+/* Returns image of given dimensions whose pixels are borrowed from pixels
+ * (width * height bytes, which must outlive the image), or NULL on malloc error.
+ * Free with pgm_free.
+ */
+struct Image *pgm_wrap(int width, int height, const unsigned char *pixels);
+
+/* Frees image made by pgm_decode (and its pixels, unless they are borrowed from a buffer) */
+void pgm_free(struct Image *img);
+
+/* Encodes image as P5 with the given maxval.
+ * Returns malloced buffer, with its length in *len, or NULL on malloc error.
+ */
+char *pgm_encode_p5(struct Image *img, int maxval, size_t *len);
+
+#endif /* PGM_H */
@@ -0,0 +1,58 @@
+#include <time.h>
+
+#include "rcu.h"
+
+
+void rcu_init(struct rcu_ptr *rp, void *ptr)
+{
+		rp->ptr = ptr;
+		rp->epoch = 0;
+		rp->readers[0] = 0;
+		rp->readers[1] = 0;
+}
+
+int rcu_read_lock(struct rcu_ptr *rp)
+{
+		unsigned long epoch;
+		int token;
+		/* Registered in epoch only if it is still current after registering:
+		 * the writer leaving that epoch then waits for this reader.
+		 * Retried only if the writer moved on in between.
+		 */
+		for (;;) {
+				epoch = __atomic_load_n(&rp->epoch, __ATOMIC_SEQ_CST);
+				token = (int) (epoch & 1);
+				__atomic_add_fetch(&rp->readers[token], 1, __ATOMIC_SEQ_CST);
+				if (__atomic_load_n(&rp->epoch, __ATOMIC_SEQ_CST) == epoch)
+						return token;
+				__atomic_sub_fetch(&rp->readers[token], 1, __ATOMIC_SEQ_CST);
+		}
+}
+
+void *rcu_read(struct rcu_ptr *rp)
+{
+		return __atomic_load_n(&rp->ptr, __ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock(struct rcu_ptr *rp, int token)
+{
+		__atomic_sub_fetch(&rp->readers[token], 1, __ATOMIC_RELEASE);
+}
+
+void *rcu_replace(struct rcu_ptr *rp, void *ptr)
+{
+		struct timespec pause;
+		unsigned long epoch;
+		void *old;
+
+		old = __atomic_exchange_n(&rp->ptr, ptr, __ATOMIC_SEQ_CST);
+		/* Readers registering from now on see ptr. Those registered in the
+		 * epoch being left may still use old: wait for them.
+		 */
+		epoch = __atomic_add_fetch(&rp->epoch, 1, __ATOMIC_SEQ_CST) - 1;
+		pause.tv_sec = 0;
+		pause.tv_nsec = 100000;
+		while (__atomic_load_n(&rp->readers[epoch & 1], __ATOMIC_ACQUIRE) > 0)
+				nanosleep(&pause, NULL);
+		return old;
+}
@@ -0,0 +1,56 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include "mpmc_queue.h"
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Pointer to shared data which one writer replaces while readers use it (RCU style).
+ * Readers never block or wait on the writer: they register in the reader count
+ * of the current epoch, use the data, and unregister.
+ * The writer publishes new data, moves on to the next epoch, and waits until every
+ * reader registered in the previous epoch is done before the old data is freed.
+ *
+ * ptr:     current data.
+ * epoch:   incremented by each replace (parity selects reader count).
+ * readers: readers registered in an even and an odd epoch (own cache lines).
+ */
+struct rcu_ptr {
+		void *ptr;
+		unsigned long epoch;
+		char pad0[CACHE_LINE - sizeof(void*) - sizeof(unsigned long)];
+		long readers[2];
+		char pad1[CACHE_LINE - 2 * sizeof(long)];
+};
+
+
+/* ===========================
+ * ======== FUNCTIONS ========
+ * ===========================
+ */
+
+/* Set initial data */
+void rcu_init(struct rcu_ptr *rp, void *ptr);
+
+/* Start of read section. Returns token for rcu_read_unlock.
+ * Data returned by rcu_read inside the section is not freed before the section ends.
+ */
+int rcu_read_lock(struct rcu_ptr *rp);
+
+/* Returns current data (inside a read section) */
+void *rcu_read(struct rcu_ptr *rp);
+
+/* End of read section started with token */
+void rcu_read_unlock(struct rcu_ptr *rp, int token);
+
+/* Publishes ptr, and waits until no reader can still use the data it replaced
+ * (a grace period). Returns replaced data, which may then be freed.
+ * Only one thread may replace at a time.
+ */
+void *rcu_replace(struct rcu_ptr *rp, void *ptr);
+
+#endif /* RCU_H */
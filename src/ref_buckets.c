@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "my_constants.h"
+#include "files.h"
+#include "ref_buckets.h"
+
+
+/* Slot where probe sequence of dimensions starts */
+static uint32_t first_slot(struct ref_buckets *rb, int width, int height)
+{
+		uint32_t h;
+		h = (uint32_t) width * 2654435761U ^ (uint32_t) height * 2246822519U;
+		return (h ^ (h >> 16)) & rb->mask;
+}
+
+/* Returns slot of bucket with dimensions, or the empty slot where it belongs */
+static struct ref_bucket *probe(struct ref_buckets *rb, int width, int height)
+{
+		struct ref_bucket *b;
+		uint32_t pos;
+		for (pos = first_slot(rb, width, height); ; pos = (pos + 1) & rb->mask) {
+				b = &rb->slots[pos];
+				if (-1 == b->width || (b->width == width && b->height == height))
+						return b;
+		}
+}
+
+int ref_buckets_build(struct ref_buckets *rb, struct file_array *fa)
+{
+		struct ref_bucket *b;
+		const char *error;
+		uint32_t n_slots, pos;
+		int i, width, height, bucketed;
+
+		n_slots = 16;
+		while (n_slots < (uint32_t) fa->entries * BUCKET_SLOTS_PER_IMAGE)
+				n_slots *= 2;
+		rb->slots = malloc(n_slots * sizeof(struct ref_bucket));
+		if (NULL == rb->slots) {
+				perror("ref_buckets_build: malloc");
+				return FAILURE;
+		}
+		rb->n_slots = n_slots;
+		rb->mask = n_slots - 1;
+		rb->n_buckets = 0;
+		for (pos = 0; pos < n_slots; pos++)
+				rb->slots[pos].width = -1;
+
+		/* In file array order, so each bucket keeps that order */
+		bucketed = 0;
+		for (i = 0; i < fa->entries; i++) {
+				/* Images which can't be decoded never match. Leaving them out means
+				 * lookups (sharing the files between threads) never try to decode them.
+				 */
+				if (NULL == fa->files[i] || NULL == file_image(fa->files[i]))
+						continue;
+				if (SUCCESS != file_dimensions(fa->files[i], &width, &height, &error))
+						continue;
+				b = probe(rb, width, height);
+				if (-1 == b->width) {
+						b->width = width;
+						b->height = height;
+						b->refs.entries = 0;
+						b->refs.total_size = 0;
+						b->refs.files = NULL;
+						rb->n_buckets++;
+				}
+				if (SUCCESS != append_file(&b->refs, fa->files[i])) {
+						ref_buckets_free(rb);
+						return FAILURE;
+				}
+				bucketed++;
+		}
+		printf("Bucketed %d of %d reference images by dimensions (%d buckets).\n",
+			   bucketed, fa->entries, rb->n_buckets);
+		return SUCCESS;
+}
+
+struct ref_bucket *ref_buckets_find(struct ref_buckets *rb, int width, int height)
+{
+		struct ref_bucket *b;
+		b = probe(rb, width, height);
+		if (-1 == b->width)
+				return NULL;
+		return b;
+}
+
+void ref_buckets_free(struct ref_buckets *rb)
+{
+		uint32_t pos;
+		for (pos = 0; pos < rb->n_slots; pos++)
+				if (rb->slots[pos].width != -1)
+						free(rb->slots[pos].refs.files);
+		free(rb->slots);
+		rb->slots = NULL;
+		rb->n_slots = 0;
+		rb->n_buckets = 0;
+}
@@ -0,0 +1,67 @@
+#ifndef REF_BUCKETS_H
+#define REF_BUCKETS_H
+
+#include <stdint.h>
+
+#include "files.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Slots per reference image (at least), as for the image index */
+#define BUCKET_SLOTS_PER_IMAGE 2
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Reference images with the same dimensions.
+ * width, height: dimensions of the images (width is -1 if slot is empty).
+ * refs:          the images, in file array order. The array does not own them
+ *                (they are freed with the file array they come from).
+ */
+struct ref_bucket {
+		int width;
+		int height;
+		struct file_array refs;
+};
+
+/* Reference images bucketed by dimensions (open addressing, linear probing).
+ * A file is only compared to (or decoded for) the bucket with its dimensions,
+ * which are read from its header (file_dimensions), so a file with dimensions
+ * no reference has is rejected after parsing a few dozen bytes.
+ *
+ * slots:     n_slots slots (power of two).
+ * mask:      n_slots - 1.
+ * n_buckets: number of buckets (distinct dimensions).
+ */
+struct ref_buckets {
+		struct ref_bucket *slots;
+		uint32_t n_slots;
+		uint32_t mask;
+		int n_buckets;
+};
+
+
+/* ===============================
+ * ====== BUCKET FUNCTIONS =======
+ * ===============================
+ */
+
+/* Puts every image in fa in the bucket of its dimensions.
+ * Images which can't be decoded are left out (they never match).
+ * Returns SUCCESS, or FAILURE on malloc error.
+ */
+int ref_buckets_build(struct ref_buckets *rb, struct file_array *fa);
+
+/* Returns bucket of images with given dimensions, or NULL if there are none */
+struct ref_bucket *ref_buckets_find(struct ref_buckets *rb, int width, int height);
+
+/* Free buckets (not the files in them) */
+void ref_buckets_free(struct ref_buckets *rb);
+
+#endif /* REF_BUCKETS_H */
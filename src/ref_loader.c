@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "my_constants.h"
+#include "files.h"
+#include "rtt.h"
+#include "image_index.h"
+#include "index_file.h"
+#include "ref_loader.h"
+
+
+/* Directory entry as returned by getdents64 (see getdents(2)) */
+struct linux_dirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+};
+
+/* True if entry name in directory dirfd is a regular file we may use */
+static bool usable_entry(int dirfd, struct linux_dirent64 *d)
+{
+		struct stat st;
+		if (DT_UNKNOWN == d->d_type) {
+				/* Type not given by file system: lstat (symbolic links are not followed) */
+				if (0 != fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+						perror("scan_reference_dir, fstatat");
+						return false;
+				}
+				if (!S_ISREG(st.st_mode))
+						return false;
+		} else if (d->d_type != DT_REG) {
+				return false;
+		}
+		if (0 != faccessat(dirfd, d->d_name, R_OK | W_OK, 0)) {
+				fprintf(stderr, "In scan_reference_dir, %s: ", d->d_name);
+				perror("");
+				return false;
+		}
+		return true;
+}
+
+int scan_reference_dir(struct string_array *sa, char dir[])
+{
+		struct linux_dirent64 *d;
+		char *buf, path[PATH_MAX];
+		long n, pos;
+		int dirfd;
+
+		dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+		if (-1 == dirfd) {
+				perror("scan_reference_dir, open");
+				return FAILURE;
+		}
+		buf = malloc(DIRENTS_BUFSIZE);
+		if (NULL == buf) {
+				perror("scan_reference_dir, malloc");
+				close(dirfd);
+				return FAILURE;
+		}
+		while ((n = syscall(SYS_getdents64, dirfd, buf, DIRENTS_BUFSIZE)) > 0) {
+				for (pos = 0; pos < n; pos += d->d_reclen) {
+						d = (struct linux_dirent64*) (buf + pos);
+						if (!usable_entry(dirfd, d))
+								continue;
+						if (snprintf(path, PATH_MAX, "%s/%s", dir, d->d_name) >= PATH_MAX) {
+								fprintf(stderr, RED "Warning:" NRM " path of %s is too long, skipped.\n", d->d_name);
+								continue;
+						}
+						add_filename(sa, path);
+				}
+		}
+		if (-1 == n)
+				perror("scan_reference_dir, getdents64");
+		free(buf);
+		close(dirfd);
+		return (-1 == n) ? FAILURE : SUCCESS;
+}
+
+/* Loader thread: loads files until none are left (skipping those taken from index file) */
+static void *load_thread(void *arg)
+{
+		struct load_task *task;
+		int i;
+		task = arg;
+		while ((i = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED)) < task->filenames->entries) {
+				if (task->files[i])
+						continue;
+				task->files[i] = load_reference(task->filenames->strings[i], task->map);
+				/* Hashed here, in parallel, rather than when index is built */
+				if (task->files[i])
+						file_hash(task->files[i]);
+		}
+		return NULL;
+}
+
+int load_references(struct file_array *fa, struct string_array *filenames, bool map,
+					int n_threads, struct index_file *ix)
+{
+		struct load_task task;
+		struct timespec start, end;
+		pthread_t *threads;
+		long us;
+		int i, n_started, loaded;
+
+		get_time(&start);
+		task.filenames = filenames;
+		task.map = map;
+		task.next = 0;
+		task.files = calloc(filenames->entries ? filenames->entries : 1, sizeof(struct file*));
+		threads = malloc(n_threads * sizeof(pthread_t));
+		if (NULL == task.files || NULL == threads) {
+				perror("load_references: malloc");
+				free(task.files);
+				free(threads);
+				return FAILURE;
+		}
+
+		/* Before threads start: they only load what is not taken from index file */
+		if (ix)
+				for (i = 0; i < filenames->entries; i++)
+						task.files[i] = index_file_lookup(ix, filenames->strings[i]);
+
+		/* Caller is one of the loaders */
+		n_started = 0;
+		for (i = 0; i < n_threads - 1; i++) {
+				if (0 != pthread_create(&threads[i], NULL, load_thread, &task)) {
+						fprintf(stderr, "Error in load_references: could not start thread %d.\n", i);
+						break;
+				}
+				n_started++;
+		}
+		load_thread(&task);
+		for (i = 0; i < n_started; i++)
+				pthread_join(threads[i], NULL);
+
+		/* Added in order of filenames, whatever order they were loaded in */
+		loaded = 0;
+		for (i = 0; i < filenames->entries; i++) {
+				if (NULL == task.files[i])
+						continue;
+				if (FAILURE == append_file(fa, task.files[i])) {
+						for (; i < filenames->entries; i++)
+								if (task.files[i])
+										free_file(task.files[i]);
+						free(task.files);
+						free(threads);
+						return FAILURE;
+				}
+				loaded++;
+		}
+		free(task.files);
+		free(threads);
+
+		get_time(&end);
+		us = time_diff_us(&end, &start);
+		printf("Loaded %d of %d reference images in %ld ms (%.0f files/s, %d threads).\n",
+			   loaded, filenames->entries, us / 1000, us > 0 ? loaded * 1e6 / us : 0.0, n_started + 1);
+		if (ix)
+				printf("%d of them unchanged since index file was written, taken from it.\n", ix->hits);
+		return SUCCESS;
+}
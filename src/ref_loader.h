@@ -0,0 +1,63 @@
+#ifndef REF_LOADER_H
+#define REF_LOADER_H
+
+#include <stdbool.h>
+
+#include "files.h"
+#include "index_file.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Max number of threads loading reference images (server option -r) */
+#define MAX_LOAD_THREADS 64
+
+/* Bytes of directory entries read per getdents64 call */
+#define DIRENTS_BUFSIZE (64 * 1024)
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Loading of reference images, shared by the loader threads.
+ * filenames: paths of images to load.
+ * files:     one slot per filename, set to the loaded file (NULL if it could not be read).
+ * map:       memory map files instead of reading them (see load_reference).
+ * next:      index of next filename to be taken by a thread (atomic).
+ */
+struct load_task {
+		struct string_array *filenames;
+		struct file **files;
+		bool map;
+		int next;
+};
+
+
+/* ==============================
+ * ====== LOADER FUNCTIONS ======
+ * ==============================
+ */
+
+/* Adds path of every regular file in directory dir, which is readable and writable
+ * (as read_strings_from_dir), to sa, in directory order.
+ * Entries are read with getdents64, many per system call, and are only stat'ed
+ * (fstatat, relative to dir) if the file system does not give their type.
+ * Returns SUCCESS, or FAILURE if dir can't be read.
+ */
+int scan_reference_dir(struct string_array *sa, char dir[]);
+
+/* Loads, decodes (load_reference) and hashes (file_hash) every file in filenames
+ * with n_threads threads, and adds them to fa in the order of filenames
+ * (files which can't be read are left out).
+ * Files unchanged since index file ix was written are taken from it instead (if ix is not NULL).
+ * Prints number of files loaded, the time taken, and files per second.
+ * Returns SUCCESS, or FAILURE on malloc error.
+ */
+int load_references(struct file_array *fa, struct string_array *filenames, bool map,
+					int n_threads, struct index_file *ix);
+
+#endif /* REF_LOADER_H */
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "my_constants.h"
+#include "files.h"
+#include "ref_buckets.h"
+#include "image_index.h"
+#include "rcu.h"
+#include "compare_pool.h"
+#include "ref_set.h"
+
+
+/* ===============================
+ * ====== SNAPSHOT FUNCTIONS =====
+ * ===============================
+ */
+struct ref_set *ref_set_build(struct file_array *fa, bool use_index)
+{
+		struct ref_set *rs;
+		rs = malloc(sizeof(struct ref_set));
+		if (NULL == rs) {
+				perror("ref_set_build: malloc");
+				return NULL;
+		}
+		rs->fa = *fa;
+		rs->indexed = false;
+		if (SUCCESS != ref_buckets_build(&rs->buckets, &rs->fa)) {
+				free(rs);
+				return NULL;
+		}
+		if (use_index) {
+				if (SUCCESS != image_index_build(&rs->index, &rs->fa)) {
+						ref_buckets_free(&rs->buckets);
+						free(rs);
+						return NULL;
+				}
+				rs->indexed = true;
+		}
+		return rs;
+}
+
+void ref_set_free(struct ref_set *rs, bool free_files)
+{
+		if (rs->indexed)
+				image_index_free(&rs->index);
+		ref_buckets_free(&rs->buckets);
+		if (free_files)
+				free_file_array(&rs->fa);
+		else
+				free(rs->fa.files);
+		free(rs);
+}
+
+
+/* ==============================
+ * ====== WATCH FUNCTIONS =======
+ * ==============================
+ */
+
+/* True if path is a regular file which may be used as reference image
+ * (as scan_reference_dir decides). Quiet if it does not exist (removed).
+ */
+static bool file_present(char path[])
+{
+		struct stat st;
+		if (0 != lstat(path, &st)) {
+				if (ENOENT != errno)
+						perror("ref_watch, lstat");
+				return false;
+		}
+		return S_ISREG(st.st_mode) && 0 == access(path, R_OK | W_OK);
+}
+
+/* Index of file with filename in fa, or -1 */
+static int find_filename(struct file_array *fa, char filename[])
+{
+		int i;
+		for (i = 0; i < fa->entries; i++)
+				if (fa->files[i] && 0 == strcmp(fa->files[i]->filename, filename))
+						return i;
+		return -1;
+}
+
+/* Loads file at path as reference image (decoded and hashed, so the snapshot
+ * is read only once published). NULL if it is gone or can't be read.
+ */
+static struct file *load_changed(struct ref_watch *w, char path[])
+{
+		struct file *f;
+		if (!file_present(path))
+				return NULL;
+		f = load_reference(path, w->map);
+		if (f)
+				file_hash(f);
+		return f;
+}
+
+/* Makes fa the files of old, with the files at paths (changed in some way) reloaded.
+ * Files keep their place, new ones are added last. Files of old which are replaced
+ * or removed are added to garbage, and files loaded to loaded.
+ * Returns SUCCESS, or FAILURE on malloc error.
+ */
+static int changed_files(struct ref_watch *w, struct file_array *old, struct string_array *paths,
+						 struct file_array *fa, struct file_array *garbage, struct file_array *loaded)
+{
+		struct file *f;
+		int i, pos;
+
+		for (i = 0; i < old->entries; i++)
+				if (SUCCESS != append_file(fa, old->files[i]))
+						return FAILURE;
+		for (i = 0; i < paths->entries; i++) {
+				f = load_changed(w, paths->strings[i]);
+				if (f && SUCCESS != append_file(loaded, f)) {
+						free_file(f);
+						return FAILURE;
+				}
+				pos = find_filename(fa, paths->strings[i]);
+				if (pos >= 0) {
+						if (SUCCESS != append_file(garbage, fa->files[pos]))
+								return FAILURE;
+						if (f) {
+								fa->files[pos] = f;
+								w->changed++;
+						} else {
+								memmove(&fa->files[pos], &fa->files[pos + 1], (fa->entries - pos - 1) * sizeof(struct file*));
+								fa->entries--;
+								fa->files[fa->entries] = NULL;
+								w->removed++;
+						}
+				} else if (f) {
+						if (SUCCESS != append_file(fa, f))
+								return FAILURE;
+						w->added++;
+				}
+		}
+		return SUCCESS;
+}
+
+/* Publishes a snapshot with the files at paths reloaded, and then frees the replaced
+ * snapshot, and files no longer in use, once no lookup uses them.
+ */
+static void apply_changes(struct ref_watch *w, struct string_array *paths)
+{
+		struct ref_set *old, *new;
+		struct file_array fa, garbage, loaded;
+
+		/* Only this thread replaces the snapshot, so it may read it without a read section */
+		old = rcu_read(&w->refs->set);
+		fa.entries = 0; fa.total_size = 0; fa.files = NULL;
+		garbage.entries = 0; garbage.total_size = 0; garbage.files = NULL;
+		loaded.entries = 0; loaded.total_size = 0; loaded.files = NULL;
+		new = NULL;
+		if (SUCCESS == changed_files(w, &old->fa, paths, &fa, &garbage, &loaded))
+				new = ref_set_build(&fa, w->use_index);
+		if (NULL == new) {
+				/* Old snapshot stays */
+				fprintf(stderr, "Error in ref_watch: reference images not updated.\n");
+				free(fa.files);
+				free(garbage.files);
+				free_file_array(&loaded);
+				return;
+		}
+		old = rcu_replace(&w->refs->set, new);
+		w->updates++;
+		printf("Reference images updated: %d images (%d files changed).\n", new->fa.entries, paths->entries);
+		ref_set_free(old, false);
+		free_file_array(&garbage);
+		free(loaded.files);
+}
+
+/* Reads pending inotify events, and adds the paths they concern to paths (once each).
+ * Returns SUCCESS, or FAILURE if the watch is broken.
+ */
+static int read_events(struct ref_watch *w, struct string_array *paths)
+{
+		struct inotify_event *ev;
+		char buf[WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+		char path[PATH_MAX];
+		ssize_t n, pos;
+		int i;
+
+		for (;;) {
+				n = read(w->watch_fd, buf, sizeof buf);
+				if (-1 == n) {
+						if (EAGAIN == errno || EINTR == errno)
+								return SUCCESS;
+						perror("ref_watch, read");
+						return FAILURE;
+				}
+				for (pos = 0; pos < n; pos += sizeof(struct inotify_event) + ev->len) {
+						ev = (struct inotify_event*) (buf + pos);
+						if (ev->mask & IN_Q_OVERFLOW)
+								fprintf(stderr, RED "Warning:" NRM " inotify events lost, some reference images may be out of date.\n");
+						if (ev->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+								fprintf(stderr, RED "Warning:" NRM " reference directory %s is gone, no longer watched.\n", w->dir);
+								return FAILURE;
+						}
+						if (0 == ev->len)
+								continue;
+						if (snprintf(path, PATH_MAX, "%s/%s", w->dir, ev->name) >= PATH_MAX)
+								continue;
+						for (i = 0; i < paths->entries; i++)
+								if (0 == strcmp(paths->strings[i], path))
+										break;
+						if (i == paths->entries)
+								add_filename(paths, path);
+				}
+		}
+}
+
+/* Watch thread: waits for changes (or stop), and applies each batch of them */
+static void *watch_thread(void *arg)
+{
+		struct ref_watch *w;
+		struct string_array paths;
+		struct pollfd fds[2];
+		int i;
+
+		w = arg;
+		fds[0].fd = w->stop_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = w->watch_fd;
+		fds[1].events = POLLIN;
+		for (;;) {
+				if (-1 == poll(fds, 2, -1)) {
+						if (EINTR == errno)
+								continue;
+						perror("ref_watch, poll");
+						break;
+				}
+				if (fds[0].revents & POLLIN)
+						break;
+				if (!(fds[1].revents & POLLIN))
+						continue;
+
+				paths.entries = 0; paths.total_size = 0;
+				if (SUCCESS != realloc_byte_array((struct byte_array*) &paths))
+						continue;
+				i = read_events(w, &paths);
+				if (paths.entries > 0)
+						apply_changes(w, &paths);
+				free_string_array(&paths);
+				if (SUCCESS != i)
+						break;
+		}
+		return NULL;
+}
+
+int ref_watch_start(struct ref_watch *w, struct references *refs, char dir[],
+					bool map, bool use_index, int stop_fd)
+{
+		w->refs = refs;
+		w->dir = dir;
+		w->map = map;
+		w->use_index = use_index;
+		w->stop_fd = stop_fd;
+		w->updates = 0;
+		w->added = 0;
+		w->changed = 0;
+		w->removed = 0;
+
+		w->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (-1 == w->watch_fd) {
+				perror("ref_watch_start, inotify_init1");
+				return FAILURE;
+		}
+		/* Written files count when closed, moved in or out counts as added or removed */
+		if (-1 == inotify_add_watch(w->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+									| IN_DELETE | IN_DELETE_SELF | IN_ONLYDIR)) {
+				perror("ref_watch_start, inotify_add_watch");
+				close(w->watch_fd);
+				return FAILURE;
+		}
+		if (0 != pthread_create(&w->thread, NULL, watch_thread, w)) {
+				fprintf(stderr, "Error in ref_watch_start: could not start thread.\n");
+				close(w->watch_fd);
+				return FAILURE;
+		}
+		printf("Watching %s for changes to reference images.\n", dir);
+		return SUCCESS;
+}
+
+void ref_watch_stop(struct ref_watch *w)
+{
+		pthread_join(w->thread, NULL);
+		close(w->watch_fd);
+		printf("Reference updates: %lu (%lu images added, %lu changed, %lu removed)\n",
+			   w->updates, w->added, w->changed, w->removed);
+}
@@ -0,0 +1,102 @@
+#ifndef REF_SET_H
+#define REF_SET_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "files.h"
+#include "ref_buckets.h"
+#include "image_index.h"
+#include "compare_pool.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Bytes of inotify events read at a time */
+#define WATCH_BUFSIZE (16 * 1024)
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Snapshot of the reference images, and the means of searching them.
+ * Never changed once published (see struct references): an update builds a new one.
+ * Snapshots share the file structs of images which did not change,
+ * so the files are not owned (freed) by a snapshot.
+ *
+ * fa:      reference images, in the order they are searched.
+ * buckets: fa bucketed by dimensions.
+ * index:   content hash index of fa (if indexed).
+ * indexed: index is built (else fa is searched bucket by bucket).
+ */
+struct ref_set {
+		struct file_array fa;
+		struct ref_buckets buckets;
+		struct image_index index;
+		bool indexed;
+};
+
+/* Watch of reference directory, which applies changes to the reference images
+ * while the server runs (files added, written or removed).
+ *
+ * thread:     thread reading the inotify events.
+ * refs:       reference images the changes are published to.
+ * dir:        reference directory (paths are "dir/name", as scan_reference_dir makes them).
+ * map:        memory map files instead of reading them (see load_reference).
+ * use_index:  build content hash index of each snapshot.
+ * watch_fd:   inotify instance.
+ * stop_fd:    eventfd which becomes readable when the server is stopped.
+ * updates:    snapshots published.
+ * added, changed, removed: files added, replaced and removed by them.
+ */
+struct ref_watch {
+		pthread_t thread;
+		struct references *refs;
+		char *dir;
+		bool map;
+		bool use_index;
+		int watch_fd;
+		int stop_fd;
+		unsigned long updates;
+		unsigned long added;
+		unsigned long changed;
+		unsigned long removed;
+};
+
+
+/* ===============================
+ * ====== SNAPSHOT FUNCTIONS =====
+ * ===============================
+ */
+
+/* Builds snapshot of the files in fa (the snapshot takes over fa's array, not the files):
+ * buckets, and index if use_index is true.
+ * Returns malloced snapshot, or NULL on malloc error.
+ */
+struct ref_set *ref_set_build(struct file_array *fa, bool use_index);
+
+/* Frees snapshot, and its files if free_files is true */
+void ref_set_free(struct ref_set *rs, bool free_files);
+
+
+/* ==============================
+ * ====== WATCH FUNCTIONS =======
+ * ==============================
+ */
+
+/* Starts watching directory dir with inotify, in a thread which publishes a new snapshot
+ * of refs for each batch of changes. Only changed files are loaded.
+ * Lookups never wait for an update: they use the snapshot current when they started.
+ * Returns SUCCESS, or FAILURE if the directory can't be watched.
+ */
+int ref_watch_start(struct ref_watch *w, struct references *refs, char dir[],
+					bool map, bool use_index, int stop_fd);
+
+/* Joins watch thread (stop_fd must be readable) and prints number of updates */
+void ref_watch_stop(struct ref_watch *w);
+
+#endif /* REF_SET_H */
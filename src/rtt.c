@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "rtt.h"
+
+
+/* ===========================
+ * ========== TIME ===========
+ * ===========================
+ */
+void get_time(struct timespec *ts)
+{
+		if (0 != clock_gettime(CLOCK_MONOTONIC, ts))
+				perror("get_time, clock_gettime");
+}
+
+long time_diff_us(struct timespec *a, struct timespec *b)
+{
+		return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+void time_add_us(struct timespec *ts, long us)
+{
+		ts->tv_sec += us / 1000000L;
+		ts->tv_nsec += (us % 1000000L) * 1000;
+		if (ts->tv_nsec >= 1000000000L) {
+				ts->tv_sec += 1;
+				ts->tv_nsec -= 1000000000L;
+		}
+}
+
+
+/* ===========================
+ * ======== ESTIMATOR ========
+ * ===========================
+ */
+
+/* Keep rto within [RTO_MIN_US, RTO_MAX_US] */
+static long bound_rto(long rto)
+{
+		if (rto < RTO_MIN_US)
+				return RTO_MIN_US;
+		if (rto > RTO_MAX_US)
+				return RTO_MAX_US;
+		return rto;
+}
+
+void rtt_init(struct rtt_estimator *est)
+{
+		est->has_sample = false;
+		est->srtt = 0;
+		est->rttvar = 0;
+		est->rto = RTO_INITIAL_US;
+		est->backoffs = 0;
+}
+
+void rtt_sample(struct rtt_estimator *est, long rtt_us)
+{
+		long err;
+		if (rtt_us < 0)
+				return;
+		if (!est->has_sample) {
+				/* First measurement */
+				est->srtt = rtt_us;
+				est->rttvar = rtt_us / 2;
+				est->has_sample = true;
+		} else {
+				/* rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt */
+				err = est->srtt - rtt_us;
+				if (err < 0)
+						err = -err;
+				est->rttvar = (3 * est->rttvar + err) / 4;
+				est->srtt = (7 * est->srtt + rtt_us) / 8;
+		}
+		est->rto = bound_rto(est->srtt + 4 * est->rttvar);
+		est->backoffs = 0;
+
+		snprintf(debug_buf, DEBUG_BUFSIZE, "RTT sample: %ld us, srtt: %ld us, rttvar: %ld us, rto: %ld us\n",
+				 rtt_us, est->srtt, est->rttvar, est->rto);  /* DEBUG */
+		debugf(debug_buf);  /* DEBUG */
+}
+
+void rtt_backoff(struct rtt_estimator *est)
+{
+		est->rto = bound_rto(est->rto * 2);
+		est->backoffs++;
+}
+
+long rtt_rto(struct rtt_estimator *est)
+{
+		return est->rto;
+}
@@ -0,0 +1,77 @@
+#ifndef RTT_H
+#define RTT_H
+
+#include <stdbool.h>
+#include <time.h>
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Retransmission timeout (microseconds) before first RTT sample */
+#define RTO_INITIAL_US 1000000L
+
+/* Bounds of retransmission timeout (microseconds) */
+#define RTO_MIN_US     10000L
+#define RTO_MAX_US  60000000L
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Smoothed round trip time estimator (RFC 6298). All times in microseconds.
+ *
+ * has_sample: at least one RTT sample has been taken.
+ * srtt:       smoothed round trip time.
+ * rttvar:     round trip time variation.
+ * rto:        current retransmission timeout (including backoff).
+ * backoffs:   number of times rto has been doubled since last sample.
+ */
+struct rtt_estimator {
+		bool has_sample;
+		long srtt;
+		long rttvar;
+		long rto;
+		int backoffs;
+};
+
+
+/* ===========================
+ * ========== TIME ===========
+ * ===========================
+ */
+
+/* Get current time from monotonic clock (not affected by changes to system time) */
+void get_time(struct timespec *ts);
+
+/* Returns a - b in microseconds */
+long time_diff_us(struct timespec *a, struct timespec *b);
+
+/* Adds us microseconds to ts */
+void time_add_us(struct timespec *ts, long us);
+
+
+/* ===========================
+ * ======== ESTIMATOR ========
+ * ===========================
+ */
+
+/* Set estimator to initial state (rto = RTO_INITIAL_US) */
+void rtt_init(struct rtt_estimator *est);
+
+/* Update srtt, rttvar and rto with a new measured round trip time.
+ * Following Karn's rule, only packets which were not retransmitted must be sampled.
+ * Clears backoff.
+ */
+void rtt_sample(struct rtt_estimator *est, long rtt_us);
+
+/* Double rto (exponential backoff on timeout), bounded by RTO_MAX_US */
+void rtt_backoff(struct rtt_estimator *est);
+
+/* Returns current retransmission timeout (microseconds) */
+long rtt_rto(struct rtt_estimator *est);
+
+#endif /* RTT_H */
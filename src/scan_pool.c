@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "files.h"
+#include "scan_pool.h"
+
+
+/* Lowers task->best to index, unless a lower match is already found */
+static void found_match(struct scan_task *task, int index)
+{
+		int best;
+		best = __atomic_load_n(&task->best, __ATOMIC_RELAXED);
+		while (index < best
+			   && !__atomic_compare_exchange_n(&task->best, &best, index, true,
+											   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+}
+
+/* Takes chunks of task until none are left below best, and compares their files.
+ * Every index below the final best is compared by someone, since chunks are taken
+ * in increasing order and best only decreases: the lowest match is always found.
+ */
+static void scan_chunks(struct scan_task *task)
+{
+		struct file *cmp_f;
+		int chunk, i, end;
+
+		for (;;) {
+				chunk = __atomic_fetch_add(&task->next_chunk, 1, __ATOMIC_RELAXED);
+				if (chunk >= task->n_chunks)
+						return;
+				i = chunk * SCAN_CHUNK;
+				end = i + SCAN_CHUNK;
+				if (end > task->fa->entries)
+						end = task->fa->entries;
+				for (; i < end; i++) {
+						/* Early cancellation: a match at a lower index is already found */
+						if (i >= __atomic_load_n(&task->best, __ATOMIC_RELAXED))
+								return;
+						cmp_f = task->fa->files[i];
+						if (cmp_f && compare_files(cmp_f, task->f)) {
+								found_match(task, i);
+								break;
+						}
+				}
+		}
+}
+
+/* Returns first search in list with chunks left (or NULL). Pool lock must be held */
+static struct scan_task *find_task(struct scan_pool *sp)
+{
+		struct scan_task *task;
+		for (task = sp->tasks; task != NULL; task = task->next)
+				if (__atomic_load_n(&task->next_chunk, __ATOMIC_RELAXED) < task->n_chunks)
+						return task;
+		return NULL;
+}
+
+/* Scan thread: helps with searches until pool is stopped */
+static void *scan_thread(void *arg)
+{
+		struct scan_pool *sp;
+		struct scan_task *task;
+
+		sp = arg;
+		pthread_mutex_lock(&sp->lock);
+		for (;;) {
+				while (!sp->stopping && NULL == (task = find_task(sp)))
+						pthread_cond_wait(&sp->work, &sp->lock);
+				if (sp->stopping)
+						break;
+				task->workers++;
+				pthread_mutex_unlock(&sp->lock);
+
+				scan_chunks(task);
+
+				pthread_mutex_lock(&sp->lock);
+				task->workers--;
+				if (0 == task->workers)
+						pthread_cond_broadcast(&sp->done);
+		}
+		pthread_mutex_unlock(&sp->lock);
+		return NULL;
+}
+
+int scan_pool_start(struct scan_pool *sp, int n_threads)
+{
+		int i;
+
+		sp->threads = malloc(n_threads * sizeof(pthread_t));
+		if (NULL == sp->threads) {
+				perror("scan_pool_start: malloc");
+				return FAILURE;
+		}
+		pthread_mutex_init(&sp->lock, NULL);
+		pthread_cond_init(&sp->work, NULL);
+		pthread_cond_init(&sp->done, NULL);
+		sp->tasks = NULL;
+		sp->stopping = false;
+
+		sp->n_threads = 0;
+		for (i = 0; i < n_threads; i++) {
+				if (0 != pthread_create(&sp->threads[i], NULL, scan_thread, sp)) {
+						fprintf(stderr, "Error in scan_pool_start: could not start thread %d.\n", i);
+						break;
+				}
+				sp->n_threads++;
+		}
+		if (0 == sp->n_threads) {
+				scan_pool_stop(sp);
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+struct file *scan_pool_find(struct scan_pool *sp, struct file_array *fa, struct file *f)
+{
+		struct scan_task task, **ptr;
+
+		if (NULL == sp || fa->entries < SCAN_PARALLEL_MIN)
+				return compare_to_all_files(fa, f);
+		/* Decode f before it is shared (file_image is not thread safe on first call) */
+		if (NULL == file_image(f))
+				return NULL;
+
+		task.fa = fa;
+		task.f = f;
+		task.next_chunk = 0;
+		task.n_chunks = (fa->entries + SCAN_CHUNK - 1) / SCAN_CHUNK;
+		task.best = fa->entries;
+		task.workers = 0;
+
+		/* Publish search, and take part in it */
+		pthread_mutex_lock(&sp->lock);
+		task.next = sp->tasks;
+		sp->tasks = &task;
+		pthread_cond_broadcast(&sp->work);
+		pthread_mutex_unlock(&sp->lock);
+
+		scan_chunks(&task);
+
+		/* No chunks left: unlist search, and wait for threads still comparing */
+		pthread_mutex_lock(&sp->lock);
+		for (ptr = &sp->tasks; *ptr != &task; ptr = &(*ptr)->next)
+				;
+		*ptr = task.next;
+		while (task.workers > 0)
+				pthread_cond_wait(&sp->done, &sp->lock);
+		pthread_mutex_unlock(&sp->lock);
+
+		if (task.best < fa->entries) {
+				debug("Found equal file!");
+				return fa->files[task.best];
+		}
+		return NULL;
+}
+
+void scan_pool_stop(struct scan_pool *sp)
+{
+		int i;
+
+		pthread_mutex_lock(&sp->lock);
+		sp->stopping = true;
+		pthread_cond_broadcast(&sp->work);
+		pthread_mutex_unlock(&sp->lock);
+		for (i = 0; i < sp->n_threads; i++)
+				pthread_join(sp->threads[i], NULL);
+
+		free(sp->threads);
+		sp->threads = NULL;
+		pthread_mutex_destroy(&sp->lock);
+		pthread_cond_destroy(&sp->work);
+		pthread_cond_destroy(&sp->done);
+}
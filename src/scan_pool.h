@@ -0,0 +1,92 @@
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "files.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Max number of scan threads (server option -p) */
+#define MAX_SCAN_THREADS 64
+
+/* Reference images compared per chunk (unit of work handed to a thread) */
+#define SCAN_CHUNK 16
+
+/* Reference sets smaller than this are scanned serially by the caller */
+#define SCAN_PARALLEL_MIN (4 * SCAN_CHUNK)
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* One search of a reference array for a file matching f.
+ * The array is split in chunks of SCAN_CHUNK, taken in increasing order by
+ * the caller and any idle scan thread. Chunks and entries at or above best are skipped,
+ * so the search stops early, but still finds the match with the lowest index.
+ *
+ * fa:         reference images.
+ * f:          file searched for.
+ * next_chunk: next chunk to be taken (atomic).
+ * n_chunks:   number of chunks in fa.
+ * best:       lowest index of a matching file found so far (fa->entries if none, atomic).
+ * workers:    threads (besides caller) working on search (protected by pool lock).
+ * next:       next search in pool's list.
+ */
+struct scan_task {
+		struct file_array *fa;
+		struct file *f;
+		int next_chunk;
+		int n_chunks;
+		int best;
+		int workers;
+		struct scan_task *next;
+};
+
+/* Threads helping searches in reference array (any number of searches at a time).
+ *
+ * n_threads: number of scan threads.
+ * threads:   the scan threads.
+ * lock:      protects tasks, stopping and the workers count of each task.
+ * work:      signaled when a search is added (or pool stops).
+ * done:      signaled when a thread leaves a search.
+ * tasks:     searches which may have chunks left.
+ * stopping:  threads exit when set.
+ */
+struct scan_pool {
+		int n_threads;
+		pthread_t *threads;
+		pthread_mutex_t lock;
+		pthread_cond_t work;
+		pthread_cond_t done;
+		struct scan_task *tasks;
+		bool stopping;
+};
+
+
+/* ==============================
+ * ====== POOL FUNCTIONS ========
+ * ==============================
+ */
+
+/* Starts n_threads scan threads.
+ * Returns SUCCESS, or FAILURE if no thread could be started.
+ */
+int scan_pool_start(struct scan_pool *sp, int n_threads);
+
+/* Same result as compare_to_all_files (first matching file in fa, or NULL),
+ * but the reference array is searched by the caller and the scan threads together.
+ * If sp is NULL, or fa is small, fa is searched by the caller only. Thread safe.
+ */
+struct file *scan_pool_find(struct scan_pool *sp, struct file_array *fa, struct file *f);
+
+/* Stops and joins scan threads. No searches may be running */
+void scan_pool_stop(struct scan_pool *sp);
+
+#endif /* SCAN_POOL_H */
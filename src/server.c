@@ -1,130 +1,899 @@
+#define _GNU_SOURCE  /* recvmmsg/sendmmsg (batch mode) */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
 
 #include "my_constants.h"
 #include "debug_print.h"
 #include "network.h"
 #include "files.h"
+#include "session.h"
+#include "batch_io.h"
+#include "rtt.h"
+#include "compare_pool.h"
+#include "ref_loader.h"
+#include "ref_set.h"
 #include "send_packet.h"
 
 /* Necessary for formatted debug printing.
  * Also used by external functions.
  */
-char debug_buf[DEBUG_BUFSIZE];
+__thread char debug_buf[DEBUG_BUFSIZE];
 int debug_mode;
 
-int main(int argc, char *argv[])
+/* Delayed ACKs: by default every packet is ACKed at once (-a 1).
+ * A held back ACK is sent after ACK_DELAY_US at the latest (-A),
+ * which must be well below the client's minimum retransmission timeout:
+ * -A is limited to below ACK_DELAY_MAX_US, so a held back ACK never makes the client time out.
+ */
+#define ACK_EVERY_DEFAULT 1
+#define ACK_DELAY_US 2000L
+#define ACK_DELAY_MAX_US (RTO_MIN_US / 2)
+
+/* Max number of sockets listened on (one per local address getaddrinfo returns) */
+#define MAX_LISTENERS 8
+
+/* Max number of worker threads (-t), each with its own sockets bound with SO_REUSEPORT */
+#define MAX_WORKERS 64
+
+/* Max number of events handled per epoll_wait */
+#define MAX_EVENTS 32
+
+/* Seconds between checks for idle sessions */
+#define EVICT_INTERVAL 1
+
+/* epoll event ids of the timers and the stop eventfd
+ * (listeners have ids 0 to MAX_LISTENERS - 1)
+ */
+#define ACK_TIMER_EVENT   MAX_LISTENERS
+#define EVICT_TIMER_EVENT (MAX_LISTENERS + 1)
+#define STOP_EVENT        (MAX_LISTENERS + 2)
+
+/* ACK statistics.
+ * data_pkts: DATA packets received.
+ * acks:      ACKs sent.
+ * immediate: ACKs sent at once for duplicates, out of order packets or filled gaps.
+ * timer:     delayed ACKs sent because their timer ran out.
+ */
+struct ack_stats {
+		unsigned long data_pkts;
+		unsigned long acks;
+		unsigned long immediate;
+		unsigned long timer;
+};
+
+/* A bound, non-blocking server socket.
+ * fd:   socket.
+ * acks: ACKs queued for next sendmmsg from this socket (batch mode, else NULL).
+ */
+struct listener {
+		int fd;
+		struct send_batch *acks;
+};
+
+/* State of one server worker, used by its server loop and the packet handling functions below.
+ * Each worker runs in its own thread, with its own sockets, epoll instance, timers and sessions.
+ * Only refs (read only), output_fd, pool and stop_fd are shared between workers.
+ *
+ * id:             worker number (0 to n_workers - 1).
+ * n_workers:      number of workers (sockets are bound with SO_REUSEPORT if more than one).
+ * thread:         thread running the worker.
+ * stop_fd:        eventfd which becomes readable when the server is stopped.
+ * listeners:      bound server sockets (ipv4, ipv6, ...), n_listeners of them.
+ * epfd:           epoll instance watching listeners and timers.
+ * ack_timerfd:    timerfd expiring when next delayed ACK is due.
+ * evict_timerfd:  timerfd expiring every EVICT_INTERVAL seconds (idle sessions).
+ * batch_mode:     receive with recvmmsg and coalesce ACKs with sendmmsg.
+ * selective_repeat: receive with Selective Repeat instead of Go-Back-N.
+ * lossy:          loss emulation is on (ACKs must go through send_packet).
+ * max_window:     largest window a session is given (clients may ask for less).
+ * ack_every:      in order packets ACKed together (1: no delayed ACKs).
+ * ack_delay_us:   longest time an ACK is held back.
+ * ack_timer_set:  some session has a delayed ACK pending.
+ * ack_timer:      earliest deadline of pending delayed ACKs (if ack_timer_set).
+ * sessions:       receive state per client.
+ * refs:           reference images (and their index).
+ * output_fd:      file which matching results are written to.
+ * pool:           compare threads received files are handed to (NULL: compared in this thread).
+ * stats:          batching statistics (batch mode).
+ * ack_stats:      ACK statistics.
+ * ack_buffer:     buffer used by load_and_send_packet (single mode).
+ * rb:             receive buffers (batch mode, else NULL).
+ * delivered:      files completed by the packets handled in one loop iteration.
+ * pkt_buffer:     receive buffer (single mode).
+ */
+struct server {
+		int id;
+		int n_workers;
+		pthread_t thread;
+		int stop_fd;
+		struct listener listeners[MAX_LISTENERS];
+		int n_listeners;
+		int epfd;
+		int ack_timerfd;
+		int evict_timerfd;
+		bool batch_mode;
+		bool selective_repeat;
+		bool lossy;
+		uint32_t max_window;
+		uint32_t ack_every;
+		long ack_delay_us;
+		bool ack_timer_set;
+		struct timespec ack_timer;
+		struct session_table sessions;
+		struct references *refs;
+		FILE *output_fd;
+		struct compare_pool *pool;
+		struct batch_stats stats;
+		struct ack_stats ack_stats;
+		char ack_buffer[PKT_BUFSIZE];
+		struct recv_batch *rb;
+		struct file_array delivered;
+		char pkt_buffer[PKT_BUFSIZE];
+};
+
+/* Send ACK to client of session, or queue it if in batch mode.
+ * The ACK is cumulative (next expected seqnum), and names packet <acked_seqnum>.
+ * Any delayed ACK of the session is covered by this one.
+ */
+static void send_ack(struct server *srv, struct session *sess, uint32_t acked_seqnum)
 {
-		/* Network struct declarations */
-		struct addrinfo hints, *addrs, *addr_ptr;
-		struct sockaddr_storage from_addr;
-		struct packet *recv_pkt, *ack_packet;
-		float loss_prob;
-		socklen_t from_addrlen;
+		struct packet *ack_packet;
+		struct listener *l;
+		ack_packet = prep_packet(ACK, sess->exp_seqnum, acked_seqnum, sess->window, NULL, 0, 0);
+		if (NULL == ack_packet)
+				return;
+		debug_print_packet(ack_packet);
+		/* Reply from the socket the client sends to */
+		l = &srv->listeners[sess->listener];
+		if (srv->batch_mode)
+				queue_packet(l->acks, ack_packet, l->fd,
+							 &sess->addr, sess->addrlen,
+							 srv->lossy, &srv->stats);
+		else
+				load_and_send_packet(ack_packet,
+									 srv->ack_buffer,
+									 l->fd,
+									 (struct sockaddr*)&sess->addr,
+									 sess->addrlen);
+		free_packet(ack_packet);
+		sess->unacked = 0;
+		sess->ack_pending = false;
+		srv->ack_stats.acks++;
+}
+
+/* Send ACK at once (duplicates, out of order packets, filled gaps),
+ * so the client can recover without waiting.
+ */
+static void send_ack_now(struct server *srv, struct session *sess, uint32_t acked_seqnum)
+{
+		srv->ack_stats.immediate++;
+		send_ack(srv, sess, acked_seqnum);
+}
+
+/* Sets timerfd of delayed ACKs to expire at ack_timer, or disarms it if no ACK is pending */
+static void arm_ack_timer(struct server *srv)
+{
+		struct itimerspec its;
+		memset(&its, 0, sizeof(struct itimerspec));
+		if (srv->ack_timer_set)
+				its.it_value = srv->ack_timer;
+		if (-1 == timerfd_settime(srv->ack_timerfd, TFD_TIMER_ABSTIME, &its, NULL))
+				perror("arm_ack_timer, timerfd_settime");
+}
+
+/* A packet was accepted in order: ACK every ack_every packets.
+ * Otherwise the ACK is held back, until more packets arrive or the timer runs out.
+ */
+static void ack_in_order(struct server *srv, struct session *sess)
+{
+		sess->unacked++;
+		if (sess->unacked >= srv->ack_every) {
+				send_ack(srv, sess, sess->last_received);
+				return;
+		}
+		if (sess->ack_pending)
+				return;
+		sess->ack_pending = true;
+		get_time(&sess->ack_deadline);
+		time_add_us(&sess->ack_deadline, srv->ack_delay_us);
+		if (!srv->ack_timer_set || time_diff_us(&sess->ack_deadline, &srv->ack_timer) < 0) {
+				srv->ack_timer = sess->ack_deadline;
+				srv->ack_timer_set = true;
+				arm_ack_timer(srv);
+		}
+}
+
+/* Sends delayed ACKs whose timer has run out, and sets ack_timer (and its timerfd)
+ * to the next deadline
+ */
+static void flush_delayed_acks(struct server *srv)
+{
+		struct session *sess;
+		struct timespec current_time;
+		int i;
+
+		get_time(&current_time);
+		if (!srv->ack_timer_set || time_diff_us(&srv->ack_timer, &current_time) > 0) {
+				arm_ack_timer(srv);
+				return;
+		}
+		srv->ack_timer_set = false;
+		for (i = 0; i < SESSION_BUCKETS; i++) {
+				for (sess = srv->sessions.buckets[i]; sess != NULL; sess = sess->next) {
+						if (!sess->ack_pending)
+								continue;
+						if (time_diff_us(&sess->ack_deadline, &current_time) <= 0) {
+								srv->ack_stats.timer++;
+								send_ack(srv, sess, sess->last_received);
+						} else if (!srv->ack_timer_set
+								   || time_diff_us(&sess->ack_deadline, &srv->ack_timer) < 0) {
+								srv->ack_timer = sess->ack_deadline;
+								srv->ack_timer_set = true;
+						}
+				}
+		}
+		arm_ack_timer(srv);
+}
+
+/* Go-Back-N receive: only the expected packet is accepted (and ACKed),
+ * everything else is discarded. Already received packets are reACKed.
+ * Files completed by the packet are appended to <delivered>.
+ */
+static void receive_go_back_n(struct server *srv, struct session *sess, struct packet *recv_pkt,
+							  char *buf, int len, struct file_array *delivered)
+{
+		struct file *recv_f;
 		int32_t pl_len;
-		int result, sockfd, rc, max_no_seqnums;
-		int8_t exp_seqnum, last_received;
+		uint32_t seqnum;
 
-		char pkt_buffer[PKT_BUFSIZE], *tmp_string;
+		seqnum = ntohl(recv_pkt->seqnum);
+		/* If received seqnum is as expected, handle payload.
+		 * Otherwise, discard and wait for correct packet.
+		 */
+		if (sess->exp_seqnum == seqnum
+			&& DATA == recv_pkt->flag
+			&& can_reassemble(&sess->reasm, buf + PKT_HEADER_SIZE, len - PKT_HEADER_SIZE)) {
+				debug("Handling payload");
+				sess->last_received = seqnum;
+				sess->exp_seqnum = seqnum + 1;
+				debug_print_packet(recv_pkt);
 
-		/* File/data handling declarations */
-		struct string_array sa;
-		struct file_array fa;
-		struct file *matching_file, *recv_f;
-		FILE *output_fd;
+				/* Copy payload fragment (from buffer) to reassembly buffer of session.
+				 * A file is returned once its last fragment has arrived.
+				 */
+				pl_len = ntohl(recv_pkt->len) - PKT_HEADER_SIZE;    /* Get payload len */
+				recv_f = unpack_payload(&sess->reasm, (buf + PKT_HEADER_SIZE), pl_len);
+				if (recv_f) {
+						debug_print_file(recv_f);  /* DEBUG */
+						append_file(delivered, recv_f);
+				}
 
-		/* Check arguments */
-	    if (!(argc == 4 || argc == 5 || argc == 6)) {
-				/* If wrong number of args: */
-				printf("Usage: ./server <portnum> <directory w/imgs> <output filename> [<pkt loss percentage (int)>] [-d]\n");
-				printf("%d arguments supplied:\n", argc);
-				print_array(argv, argc);
-				exit(EXIT_FAILURE);
+				/* Send ACK (possibly delayed, covering several packets) */
+				ack_in_order(srv, sess);
 		}
-		if (!(valid_filename(argv[3]))) {
-				/* Or invalid filename: */
-				fprintf(stderr, "Exiting.\n");
-				exit(EXIT_FAILURE);
+		else if (already_received(seqnum, sess->exp_seqnum, sess->peer_window)) {
+				/* (re)acknowledge a packet which is already received.
+				 * Peer may have a whole window of them in flight.
+				 */
+				debug("Already received: ack and discard packet\n");
+				send_ack_now(srv, sess, seqnum);
+		} else if (sess->exp_seqnum == seqnum) {
+				/* Expected packet, but fragment can't be reassembled now: no ACK */
+				debug("Expected packet dropped (reassembly not possible now)\n");
+		} else {
+				debug(RED "Unexpected error" NRM ": couldn't identify seqnum. Might be out of bounds.\n");
 		}
-		/* Check optionals */
-		if (argc == 5 && (strcmp(argv[4], "-d") == 0)) {
-				/* Only debug parameter has been set */
-				printf("----- DEBUG MODE -----\n");
-				debug_mode = true;
-				loss_prob = 0.0f;
-		} else if (argc == 5) {
-				/* Only loss percentage has been set */
-				debug_mode = false;
-				loss_prob = ((float) atoi(argv[4])) / 100;
-		} else if (argc == 6 && (strcmp(argv[5], "-d") == 0)) {
-				/* Both. First must be loss percentage, second debug param */
-				printf("----- DEBUG MODE -----\n");
-				loss_prob = ((float) atoi(argv[4])) / 100;
-				debug_mode = true;
+}
+
+/* Delivers payload of expected packet (buf, len bytes) to reassembly buffer,
+ * and advances exp_seqnum. Returns false (and does nothing) if it can't be reassembled now.
+ */
+static bool deliver_packet(struct session *sess, char *buf, int len, struct file_array *delivered)
+{
+		struct file *recv_f;
+		if (!can_reassemble(&sess->reasm, buf + PKT_HEADER_SIZE, len - PKT_HEADER_SIZE))
+				return false;
+		sess->last_received = sess->exp_seqnum;
+		sess->exp_seqnum += 1;
+		recv_f = unpack_payload(&sess->reasm, buf + PKT_HEADER_SIZE, len - PKT_HEADER_SIZE);
+		if (recv_f) {
+				debug_print_file(recv_f);  /* DEBUG */
+				append_file(delivered, recv_f);
+		}
+		return true;
+}
+
+/* Selective Repeat receive: packets inside the window are ACKed individually,
+ * and packets ahead of exp_seqnum are kept in the session's reorder buffer
+ * until the gap before them is filled. Payloads are delivered in order.
+ * Only ACKs of packets arriving in order may be delayed.
+ * Files completed are appended to <delivered>.
+ */
+static void receive_selective_repeat(struct server *srv, struct session *sess, struct packet *recv_pkt,
+									 char *buf, int len, struct file_array *delivered)
+{
+		char *buffered;
+		int buffered_len;
+		bool accepted, in_order, filled_gap;
+		uint32_t seqnum, recv_seqnum;
+
+		recv_seqnum = seqnum = ntohl(recv_pkt->seqnum);
+		accepted = false;
+		in_order = false;
+		filled_gap = false;
+		if (DATA == recv_pkt->flag && in_window(seqnum, sess->exp_seqnum, sess->window)) {
+				debug_print_packet(recv_pkt);
+				if (seqnum == sess->exp_seqnum) {
+						/* In order: deliver directly from receive buffer */
+						accepted = in_order = deliver_packet(sess, buf, len, delivered);
+				} else if (get_buffered_packet(sess, seqnum, &buffered_len)) {
+						/* Duplicate of packet already waiting in reorder buffer */
+						accepted = true;
+				} else if (can_reassemble(&sess->reasm, buf + PKT_HEADER_SIZE, len - PKT_HEADER_SIZE)) {
+						/* Out of order: keep copy until the gap before it is filled */
+						debug("Out of order: buffering packet\n");
+						accepted = buffer_packet(sess, seqnum, buf, len);
+				}
+				/* Deliver buffered packets which are now in order */
+				while ((buffered = get_buffered_packet(sess, sess->exp_seqnum, &buffered_len))) {
+						seqnum = sess->exp_seqnum;
+						if (!deliver_packet(sess, buffered, buffered_len, delivered))
+								break;
+						release_buffered_packet(sess, seqnum);
+						filled_gap = true;
+				}
+				/* ACK this packet (and cumulatively everything before exp_seqnum) */
+				if (in_order && !filled_gap)
+						ack_in_order(srv, sess);
+				else if (accepted)
+						send_ack_now(srv, sess, recv_seqnum);
+		} else if (already_received(seqnum, sess->exp_seqnum, sess->peer_window)) {
+				/* (re)acknowledge a packet which is already delivered */
+				debug("Already received: ack and discard packet\n");
+				send_ack_now(srv, sess, seqnum);
 		} else {
-				loss_prob = 0.08f; /* Default 8% loss prob */
+				debug(RED "Unexpected error" NRM ": couldn't identify seqnum. Might be out of bounds.\n");
 		}
+}
 
-		/* DEBUG: print arguments */
-		snprintf(debug_buf, DEBUG_BUFSIZE, "argc: %d\n", argc);  /* DEBUG */
-		debugf(debug_buf);                                       /* DEBUG */
-		debug_print_array(argv, argc);                           /* DEBUG */
+/* Handles one received datagram (in buf, len bytes) from client <from>,
+ * which arrived on listener <l>:
+ * looks up session of client, runs receive logic of protocol and (re)ACKs.
+ * Files completed by the packet are appended to <delivered>
+ * (caller compares them and frees them with handle_file).
+ */
+static void handle_packet(struct server *srv, int l, char *buf, int len,
+						  struct sockaddr_storage *from, socklen_t from_addrlen,
+						  struct file_array *delivered)
+{
+		struct packet *recv_pkt;
+		struct session *sess;
+
+		snprintf(debug_buf, DEBUG_BUFSIZE, "Received %d bytes\n", len); /* DEBUG */
+		debugf(debug_buf);                                              /* DEBUG */
+
+		/* Get packet type */
+		recv_pkt = (len >= PKT_HEADER_SIZE) ? get_packet_header(buf) : NULL;
+		if (NULL == recv_pkt || (int32_t) ntohl(recv_pkt->len) != len) {
+				fprintf(stderr, RED "Warning:" NRM " received unknown or truncated packet.\n");
+				free_packet(recv_pkt);
+				return;
+		}
 
+		/* Look up receive state of sending client (new client: new session) */
+		sess = get_session(&srv->sessions, from);
+		if (NULL == sess) {
+				if (TERM == recv_pkt->flag) {
+						/* TERM from unknown peer (e.g. already evicted): nothing to close */
+						free_packet(recv_pkt);
+						return;
+				}
+				sess = add_session(&srv->sessions, from, from_addrlen,
+								   ntohs(recv_pkt->window), srv->max_window);
+				if (NULL == sess) {
+						free_packet(recv_pkt);
+						return;
+				}
+				printf("New connection from %s (window %u).\n", sess->name, sess->window);
+		}
+		sess->last_active = time(NULL);
+		sess->listener = l;
 
-		/* ----- NETWORK SETUP ----- */
+		printf(GRN "\n--- Received packet ---"NRM" (%s)\n", sess->name);
+		printf("Seqnum: %u, expecting seqnum: %u\n", ntohl(recv_pkt->seqnum), sess->exp_seqnum);
 
-		/* Ensure pkt_buffer is zero */
-		memset(pkt_buffer, 0, PKT_BUFSIZE);
+		if (TERM == recv_pkt->flag) {
+				/* Only this client's session is closed, server keeps running */
+				printf("Connection terminated (%s).\n", sess->name);
+				remove_session(&srv->sessions, sess);
+		} else if (srv->selective_repeat) {
+				srv->ack_stats.data_pkts++;
+				receive_selective_repeat(srv, sess, recv_pkt, buf, len, delivered);
+		} else {
+				srv->ack_stats.data_pkts++;
+				receive_go_back_n(srv, sess, recv_pkt, buf, len, delivered);
+		}
+		free_packet(recv_pkt);
+}
 
-		from_addrlen = sizeof(struct sockaddr_storage);
+/* Hands received file over to the compare pool, or (without pool) compares it
+ * to loaded file array, writes result to output file and frees the received file.
+ */
+static void handle_file(struct server *srv, struct file *recv_f)
+{
+		char *tmp_string;
+
+		if (srv->pool) {
+				compare_pool_submit(srv->pool, recv_f);
+				return;
+		}
+		/* Handle image (create struct and compare to loaded file array) */
+		tmp_string = compare_result_line(srv->refs, recv_f);
+		/* Write result from image compare to output file.
+		 * Flushed, since the server runs until stopped.
+		 * Workers share the file: the stream is locked so lines are not mixed.
+		 */
+		flockfile(srv->output_fd);
+		write_to_file(tmp_string, srv->output_fd);
+		fflush(srv->output_fd);
+		funlockfile(srv->output_fd);
+		free(tmp_string);
+		free_file(recv_f);
+}
+
+/* Adds fd to epoll set of server (readable events), with event id <id> */
+static int watch_fd(struct server *srv, int fd, uint32_t id)
+{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN;
+		ev.data.u32 = id;
+		if (-1 == epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+				perror("watch_fd, epoll_ctl");
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+/* Creates a non-blocking socket bound to <port> for every local address
+ * getaddrinfo returns (typically one ipv4 and one ipv6), and adds them to epoll set.
+ * With several workers, every worker binds its own sockets with SO_REUSEPORT,
+ * and the kernel spreads clients over them (by address, so a client stays with one worker).
+ * Returns number of sockets bound.
+ */
+static int open_listeners(struct server *srv, char *port)
+{
+		struct addrinfo hints, *addrs, *addr_ptr;
+		int result, sockfd, yes;
 
 		memset(&hints, 0, sizeof(struct addrinfo));
 		hints.ai_flags = AI_PASSIVE;
 		hints.ai_family = AF_UNSPEC;
 		hints.ai_socktype = SOCK_DGRAM;
 
-		if ((result = getaddrinfo(NULL, argv[1], &hints, &addrs)) != 0) {
-				fprintf(stderr, "Error main - getaddrinfo: %s\n", gai_strerror(result));
-				exit(EXIT_FAILURE);
+		if ((result = getaddrinfo(NULL, port, &hints, &addrs)) != 0) {
+				fprintf(stderr, "Error open_listeners - getaddrinfo: %s\n", gai_strerror(result));
+				return 0;
 		}
 
-		/* Loop through all addrs and get a socket */
-		addr_ptr = addrs;
-		while (addr_ptr) {
+		srv->n_listeners = 0;
+		yes = 1;
+		for (addr_ptr = addrs; addr_ptr && srv->n_listeners < MAX_LISTENERS; addr_ptr = addr_ptr->ai_next) {
 				sockfd = socket(addr_ptr->ai_family,
 								addr_ptr->ai_socktype,
 								addr_ptr->ai_protocol);
 				if (-1 == sockfd) {
-						perror("main: Error creating socket");
-				} else {
-						break;
+						perror("open_listeners: Error creating socket");
+						continue;
 				}
-				addr_ptr = addr_ptr->ai_next;
+				/* Allow reuse of address/socket.
+				 * ipv6 socket only takes ipv6, so an ipv4 socket can bind the same port.
+				 */
+				if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) == -1)
+						perror("open_listeners setsockopt (SO_REUSEADDR)");
+				if (srv->n_workers > 1
+					&& setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) == -1)
+						perror("open_listeners setsockopt (SO_REUSEPORT)");
+				if (AF_INET6 == addr_ptr->ai_family
+					&& setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof yes) == -1)
+						perror("open_listeners setsockopt (IPV6_V6ONLY)");
+				if (-1 == bind(sockfd, addr_ptr->ai_addr, addr_ptr->ai_addrlen)) {
+						perror("open_listeners, bind");
+						close(sockfd);
+						continue;
+				}
+				if (fcntl(sockfd, F_SETFL, O_NONBLOCK) != 0
+					|| SUCCESS != watch_fd(srv, sockfd, srv->n_listeners)) {
+						perror("open_listeners, fcntl");
+						close(sockfd);
+						continue;
+				}
+				if (0 == srv->id)
+						printf("Listening on %s port %s.\n", (AF_INET6 == addr_ptr->ai_family) ? "ipv6" : "ipv4", port);
+				srv->listeners[srv->n_listeners].fd = sockfd;
+				srv->listeners[srv->n_listeners].acks = NULL;
+				srv->n_listeners++;
 		}
-		/* If we got to end of list without a sockfd */
-		if (!sockfd) {
-				fprintf(stderr, "Got no socket\n.");
-				exit(EXIT_FAILURE);
+		freeaddrinfo(addrs);
+		return srv->n_listeners;
+}
+
+/* Creates a non-blocking timerfd (monotonic clock) and adds it to epoll set.
+ * If interval_sec > 0 the timer expires every interval_sec seconds,
+ * otherwise it is disarmed until set with timerfd_settime.
+ * Returns fd of timer, or -1 on error.
+ */
+static int create_timer(struct server *srv, uint32_t id, long interval_sec)
+{
+		struct itimerspec its;
+		int fd;
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (-1 == fd) {
+				perror("create_timer, timerfd_create");
+				return -1;
+		}
+		memset(&its, 0, sizeof(struct itimerspec));
+		its.it_value.tv_sec = interval_sec;
+		its.it_interval.tv_sec = interval_sec;
+		if (-1 == timerfd_settime(fd, 0, &its, NULL) || SUCCESS != watch_fd(srv, fd, id)) {
+				perror("create_timer, timerfd_settime");
+				close(fd);
+				return -1;
+		}
+		return fd;
+}
+
+/* Consumes expiration count of timerfd (it stays readable until read) */
+static void read_timer(int fd)
+{
+		uint64_t expirations;
+		if (-1 == read(fd, &expirations, sizeof expirations) && EAGAIN != errno)
+				perror("read_timer");
+}
+
+/* Receives datagrams waiting on listener <l> and handles them.
+ * At most BATCH_SIZE are taken, so other sockets and timers get their turn
+ * (epoll reports the socket again if there is more to read).
+ */
+static void read_listener(struct server *srv, int l)
+{
+		struct recv_batch *rb;
+		struct sockaddr_storage from_addr;
+		socklen_t from_addrlen;
+		int rc, i, fd;
+
+		fd = srv->listeners[l].fd;
+		rb = srv->rb;
+		if (srv->batch_mode) {
+				/* Receive all queued datagrams with one syscall */
+				rc = recv_batch(fd, rb, &srv->stats);
+				if (-1 == rc) {
+						if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+								perror("read_listener, recvmmsg");
+						return;
+				}
+				for (i = 0; i < rc; i++)
+						handle_packet(srv, l, rb->bufs[i], rb->msgs[i].msg_len,
+									  &rb->addrs[i], rb->msgs[i].msg_hdr.msg_namelen,
+									  &srv->delivered);
+				return;
+		}
+		for (i = 0; i < BATCH_SIZE; i++) {
+				from_addrlen = sizeof(struct sockaddr_storage);
+				rc = (int) recvfrom(fd, srv->pkt_buffer,
+									PKT_BUFSIZE,
+									0,
+									(struct sockaddr*)&from_addr,
+									&from_addrlen);
+				if (-1 == rc) {
+						/* Socket drained (or signal) */
+						if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+								perror("read_listener, recvfrom");
+						return;
+				}
+				handle_packet(srv, l, srv->pkt_buffer, rc, &from_addr, from_addrlen, &srv->delivered);
+		}
+}
+
+/* Sets up sockets, epoll instance, timers, sessions and buffers of worker.
+ * Configuration (options, refs, output_fd, stop_fd, id and n_workers) must be set first.
+ * Returns SUCCESS, or FAILURE if the worker can't run.
+ */
+static int init_worker(struct server *srv, char *port)
+{
+		int l;
+
+		/* One epoll instance multiplexes all sockets and timers of the worker */
+		srv->epfd = epoll_create1(0);
+		if (-1 == srv->epfd) {
+				perror("init_worker, epoll_create1");
+				return FAILURE;
 		}
-		/* Bind socket to port. */
-		if (-1 == bind(sockfd, addr_ptr->ai_addr, addr_ptr->ai_addrlen)) {
-				perror("main, bind:");
+		if (0 == open_listeners(srv, port)) {
+				fprintf(stderr, "Got no socket.\n");
+				return FAILURE;
+		}
+		/* Delayed ACK timer is armed when needed, eviction timer runs periodically */
+		srv->ack_timerfd = create_timer(srv, ACK_TIMER_EVENT, 0);
+		srv->evict_timerfd = create_timer(srv, EVICT_TIMER_EVENT, EVICT_INTERVAL);
+		if (-1 == srv->ack_timerfd || -1 == srv->evict_timerfd)
+				return FAILURE;
+		if (SUCCESS != watch_fd(srv, srv->stop_fd, STOP_EVENT))
+				return FAILURE;
+
+		srv->ack_timer_set = false;
+		memset(&srv->ack_stats, 0, sizeof(struct ack_stats));
+		init_session_table(&srv->sessions);
+		srv->delivered.entries = 0; srv->delivered.total_size = 0;
+		realloc_byte_array((struct byte_array*)&srv->delivered);
+		init_batch_stats(&srv->stats);
+		memset(srv->pkt_buffer, 0, PKT_BUFSIZE);
+		srv->rb = NULL;
+		if (srv->batch_mode) {
+				srv->rb = malloc(sizeof(struct recv_batch));
+				if (NULL == srv->rb) {
+						perror("init_worker: malloc of batch buffers");
+						return FAILURE;
+				}
+				init_recv_batch(srv->rb);
+				for (l = 0; l < srv->n_listeners; l++) {
+						srv->listeners[l].acks = malloc(sizeof(struct send_batch));
+						if (NULL == srv->listeners[l].acks) {
+								perror("init_worker: malloc of batch buffers");
+								return FAILURE;
+						}
+						init_send_batch(srv->listeners[l].acks);
+				}
+		}
+		return SUCCESS;
+}
+
+/* Server loop of one worker (thread start routine, arg is its struct server).
+ * Runs until stop_fd becomes readable.
+ */
+static void *run_worker(void *arg)
+{
+		struct server *srv;
+		struct epoll_event events[MAX_EVENTS];
+		int n_events, i, l;
+		uint32_t id;
+		bool running;
+
+		srv = arg;
+		running = true;
+		while (running) {
+				/* Wait for packets on any socket, or for a timer */
+				debug("Waiting for packets\n");
+				n_events = epoll_wait(srv->epfd, events, MAX_EVENTS, -1);
+				if (-1 == n_events) {
+						if (EINTR != errno)
+								perror("run_worker, epoll_wait");
+						continue;
+				}
+				for (i = 0; i < n_events; i++) {
+						id = events[i].data.u32;
+						if (ACK_TIMER_EVENT == id) {
+								/* Send delayed ACKs which are due */
+								read_timer(srv->ack_timerfd);
+								flush_delayed_acks(srv);
+						} else if (EVICT_TIMER_EVENT == id) {
+								/* Evict sessions of clients which have gone quiet */
+								read_timer(srv->evict_timerfd);
+								evict_idle_sessions(&srv->sessions, time(NULL), SESSION_IDLE_TIMEOUT);
+						} else if (STOP_EVENT == id) {
+								/* Not read: stays readable for the other workers */
+								running = false;
+						} else {
+								read_listener(srv, (int) id);
+						}
+				}
+				/* Handle all packets first, so the ACKs leave in one sendmmsg (per socket)
+				 * before any (slow) image comparison is done.
+				 */
+				if (srv->batch_mode)
+						for (l = 0; l < srv->n_listeners; l++)
+								flush_send_batch(srv->listeners[l].acks, srv->listeners[l].fd, srv->lossy, &srv->stats);
+
+				/* Compare (or hand over) files completed by the packet(s), and empty the array */
+				for (i = 0; i < srv->delivered.entries; i++) {
+						handle_file(srv, srv->delivered.files[i]);
+						srv->delivered.files[i] = NULL;
+				}
+				srv->delivered.entries = 0;
+		}
+		return NULL;
+}
+
+/* Frees everything set up by init_worker */
+static void free_worker(struct server *srv)
+{
+		int l;
+		free_session_table(&srv->sessions);
+		free(srv->rb);
+		for (l = 0; l < srv->n_listeners; l++) {
+				free(srv->listeners[l].acks);
+				close(srv->listeners[l].fd);
+		}
+		close(srv->ack_timerfd);
+		close(srv->evict_timerfd);
+		close(srv->epfd);
+		free_file_array(&srv->delivered);
+}
+
+int main(int argc, char *argv[])
+{
+		struct server config, *workers;
+		struct compare_pool pool;
+		struct scan_pool scan;
+		struct ref_set *set;
+		struct ref_watch watch;
+		struct index_file ixf;
+		char *index_path;
+		struct references refs;
+		bool use_index, map_refs, watch_refs;
+		struct batch_stats total_stats;
+		struct ack_stats total_acks;
+		sigset_t stop_signals;
+		float loss_prob;
+		int i, n_workers, n_compare, n_scan, n_load, n_started, open_sessions, sig;
+		struct timespec load_start, load_end;
+		uint64_t one;
+
+		/* File/data handling declarations */
+		struct string_array sa;
+		struct file_array fa;
+		FILE *output_fd;
+
+		/* Check arguments */
+	    if (argc < 4 || argc > 27) {
+				/* If wrong number of args: */
+				printf("Usage: ./server <portnum> <directory w/imgs> <output filename> [<pkt loss percentage (int)>] [-d] [-b] [-s] [-w <max window>] [-a <ack every n>] [-A <ack delay (us)>] [-t <threads>] [-c <compare threads>] [-p <scan threads>] [-l] [-m] [-r <load threads>] [-i <index file>] [-u]\n");
+				printf("%d arguments supplied:\n", argc);
+				print_array(argv, argc);
 				exit(EXIT_FAILURE);
 		}
-		/* Allow reuse of address/socket */
-		int yes = 1;
-		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) == -1) {
-				perror("main setsockopt");
+		if (!(valid_filename(argv[3]))) {
+				/* Or invalid filename: */
+				fprintf(stderr, "Exiting.\n");
 				exit(EXIT_FAILURE);
 		}
+		/* Check optionals. Loss percentage (if any) must come first.
+		 * -d: debug mode, -b: batched I/O (recvmmsg/sendmmsg),
+		 * -s: Selective Repeat (reorder buffer) instead of Go-Back-N.
+		 * -w <n>: largest window given to a session (1 to MAX_WINSIZE).
+		 * -a <n>: ACK every n packets received in order (delayed ACKs),
+		 * -A <us>: but hold an ACK back no longer than us microseconds.
+		 * -t <n>: n worker threads, each with its own SO_REUSEPORT sockets.
+		 * -c <n>: n threads comparing received files (0: compared by worker threads).
+		 * -l: linear search in reference images, instead of looking them up in content hash index.
+		 * -p <n>: n threads helping each linear search (0: serial search).
+		 * -m: memory map reference images instead of reading them into the heap.
+		 * -r <n>: n threads loading reference images at startup (default: one per CPU).
+		 * -i <file>: keep decoded reference images in index file, and only load changed ones.
+		 * -u: watch reference directory, and update reference images when files change.
+		 */
+		debug_mode = false;
+		memset(&config, 0, sizeof(struct server));
+		config.batch_mode = false;
+		config.selective_repeat = false;
+		config.max_window = MAX_WINSIZE;
+		config.ack_every = ACK_EVERY_DEFAULT;
+		config.ack_delay_us = ACK_DELAY_US;
+		n_workers = 1;
+		n_compare = COMPARE_THREADS_DEFAULT;
+		n_scan = 0;
+		n_load = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if (n_load < 1)
+				n_load = 1;
+		if (n_load > MAX_LOAD_THREADS)
+				n_load = MAX_LOAD_THREADS;
+		use_index = true;
+		map_refs = false;
+		index_path = NULL;
+		watch_refs = false;
+		loss_prob = 0.0f;
+		for (i = 4; i < argc; i++) {
+				if (strcmp(argv[i], "-d") == 0) {
+						printf("----- DEBUG MODE -----\n");
+						debug_mode = true;
+				} else if (strcmp(argv[i], "-b") == 0) {
+						printf("----- BATCHED I/O -----\n");
+						config.batch_mode = true;
+				} else if (strcmp(argv[i], "-s") == 0) {
+						printf("----- SELECTIVE REPEAT -----\n");
+						config.selective_repeat = true;
+				} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+						i++;
+						if (atoi(argv[i]) < 1 || atoi(argv[i]) > MAX_WINSIZE) {
+								fprintf(stderr, "Window size must be between 1 and %d. Exiting.\n", MAX_WINSIZE);
+								exit(EXIT_FAILURE);
+						}
+						config.max_window = atoi(argv[i]);
+				} else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+						i++;
+						if (atoi(argv[i]) < 1) {
+								fprintf(stderr, "ACK every n packets: n must be at least 1. Exiting.\n");
+								exit(EXIT_FAILURE);
+						}
+						config.ack_every = atoi(argv[i]);
+				} else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+						i++;
+						if (atol(argv[i]) < 1 || atol(argv[i]) >= ACK_DELAY_MAX_US) {
+								fprintf(stderr, "ACK delay must be between 1 and %ld us (below half the client's minimum timeout). Exiting.\n",
+										ACK_DELAY_MAX_US - 1);
+								exit(EXIT_FAILURE);
+						}
+						config.ack_delay_us = atol(argv[i]);
+				} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+						i++;
+						if (atoi(argv[i]) < 1 || atoi(argv[i]) > MAX_WORKERS) {
+								fprintf(stderr, "Number of threads must be between 1 and %d. Exiting.\n", MAX_WORKERS);
+								exit(EXIT_FAILURE);
+						}
+						n_workers = atoi(argv[i]);
+				} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+						i++;
+						if (atoi(argv[i]) < 0 || atoi(argv[i]) > MAX_COMPARE_THREADS) {
+								fprintf(stderr, "Number of compare threads must be between 0 and %d. Exiting.\n", MAX_COMPARE_THREADS);
+								exit(EXIT_FAILURE);
+						}
+						n_compare = atoi(argv[i]);
+				} else if (strcmp(argv[i], "-l") == 0) {
+						printf("----- LINEAR SEARCH -----\n");
+						use_index = false;
+				} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+						i++;
+						if (atoi(argv[i]) < 0 || atoi(argv[i]) > MAX_SCAN_THREADS) {
+								fprintf(stderr, "Number of scan threads must be between 0 and %d. Exiting.\n", MAX_SCAN_THREADS);
+								exit(EXIT_FAILURE);
+						}
+						n_scan = atoi(argv[i]);
+				} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+						i++;
+						if (atoi(argv[i]) < 1 || atoi(argv[i]) > MAX_LOAD_THREADS) {
+								fprintf(stderr, "Number of load threads must be between 1 and %d. Exiting.\n", MAX_LOAD_THREADS);
+								exit(EXIT_FAILURE);
+						}
+						n_load = atoi(argv[i]);
+				} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+						i++;
+						index_path = argv[i];
+				} else if (strcmp(argv[i], "-u") == 0) {
+						printf("----- LIVE REFERENCE UPDATES -----\n");
+						watch_refs = true;
+				} else if (strcmp(argv[i], "-m") == 0) {
+						printf("----- MAPPED REFERENCE IMAGES -----\n");
+						map_refs = true;
+				} else if (4 == i) {
+						loss_prob = ((float) atoi(argv[i])) / 100;
+				} else {
+						fprintf(stderr, "Unknown option '%s'. Exiting.\n", argv[i]);
+						exit(EXIT_FAILURE);
+				}
+		}
+
+		/* DEBUG: print arguments */
+		snprintf(debug_buf, DEBUG_BUFSIZE, "argc: %d\n", argc);  /* DEBUG */
+		debugf(debug_buf);                                       /* DEBUG */
+		debug_print_array(argv, argc);                           /* DEBUG */
 
 
 		/* --- FILES --- */
@@ -136,106 +905,150 @@ int main(int argc, char *argv[])
 		realloc_byte_array((struct byte_array*)&fa);
 
 		/* Get filenames of all valid files from argv <directory>. */
-		read_strings_from_dir(&sa, argv[2]);
+		get_time(&load_start);
+		scan_reference_dir(&sa, argv[2]);
 
-		/* Add all files to file_array */
-		int i;
-		for (i = 0; i < sa.entries; i++)
-				add_file_to_array(&fa, sa.strings[i]);
+		/* Add all files to file_array, decoded once and for all, by n_load threads
+		 * (not changed after this, so workers share it).
+		 * Files unchanged since index file was written are taken from it.
+		 */
+		if (index_path && SUCCESS != index_file_open(&ixf, index_path))
+				exit(EXIT_FAILURE);
+		if (SUCCESS != load_references(&fa, &sa, map_refs, n_load, index_path ? &ixf : NULL))
+				exit(EXIT_FAILURE);
+		/* Server runs without it if it can't be written */
+		if (index_path && index_file_stale(&ixf, &fa))
+				index_file_write(&ixf, &fa);
 
 		/* Open file which image matching results are written to */
 		output_fd = open_file(argv[3], "w");
 
 		set_loss_probability(loss_prob);
-		exp_seqnum = 0;
-		max_no_seqnums = WINSIZE + 1;
 
-		/* ----- Server loop ----- */
-		while (1) {
-				debug("Waiting for packets\n");
-				/* Receive packet */
-				rc = (int) recvfrom(sockfd, pkt_buffer,
-									PKT_BUFSIZE,
-									0,
-									(struct sockaddr*)&from_addr,
-									&from_addrlen);
-				snprintf(debug_buf, DEBUG_BUFSIZE, "Received %d bytes\n", rc); /* DEBUG */
-				debugf(debug_buf);                                             /* DEBUG */
 
-				/* Get packet type */
-				recv_pkt = get_packet_header(pkt_buffer);
+		/* ----- WORKERS ----- */
+		config.lossy = (loss_prob > 0.0f);
+		refs.scan = NULL;
+		refs.lookups = 0;
+		refs.header_rejects = 0;
+		config.refs = &refs;
+		config.output_fd = output_fd;
+		config.pool = NULL;
+		config.n_workers = n_workers;
+		config.stop_fd = eventfd(0, EFD_NONBLOCK);
+		if (-1 == config.stop_fd) {
+				perror("main, eventfd");
+				exit(EXIT_FAILURE);
+		}
 
-				printf(GRN "\n--- Received packet ---"NRM"\n");
-				printf("Seqnum: %u, expecting seqnum: %u\n", recv_pkt->seqnum, exp_seqnum);
+		/* Ctrl-C and kill are taken by sigwait below.
+		 * Blocked before threads are created, so workers inherit the mask.
+		 */
+		sigemptyset(&stop_signals);
+		sigaddset(&stop_signals, SIGINT);
+		sigaddset(&stop_signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
 
-				if (TERM == recv_pkt->flag) {
-						printf("Connection terminated.\n");
-						free(recv_pkt);
-						break;
-				}
-				/* If received seqnum is as expected, handle payload.
-				 * Otherwise, discard and wait for correct packet.
-				 */
-				if (exp_seqnum == recv_pkt->seqnum) {
-						debug("Handling payload");
-						last_received = recv_pkt->seqnum;
-						exp_seqnum = (recv_pkt->seqnum + 1) % max_no_seqnums;
-						debug_print_packet(recv_pkt);
-
-						/* Copy payload (from buffer) to dynamically allocated data structures */
-						pl_len = ntohl(recv_pkt->len) - PKT_HEADER_SIZE;    /* Get payload len */
-						recv_f = unpack_payload((pkt_buffer + PKT_HEADER_SIZE), pl_len);
-						debug_print_file(recv_f);  /* DEBUG */
+		/* Reference images are bucketed by dimensions, and then looked up by content hash,
+		 * or (large sets) searched in parallel if linear search is chosen.
+		 * The snapshot takes over the file array.
+		 */
+		set = ref_set_build(&fa, use_index);
+		if (NULL == set)
+				exit(EXIT_FAILURE);
+		rcu_init(&refs.set, set);
+		if (!use_index && n_scan > 0) {
+				if (SUCCESS != scan_pool_start(&scan, n_scan))
+						exit(EXIT_FAILURE);
+				refs.scan = &scan;
+		}
+		get_time(&load_end);
+		printf("Reference images ready in %ld ms.\n", time_diff_us(&load_end, &load_start) / 1000);
+		/* Server runs with the images it has if the directory can't be watched */
+		if (watch_refs && SUCCESS != ref_watch_start(&watch, &refs, argv[2], map_refs, use_index, config.stop_fd))
+				watch_refs = false;
+		/* Received files are compared by a pool of threads, not by the network threads */
+		if (n_compare > 0) {
+				if (SUCCESS != compare_pool_start(&pool, &refs, output_fd, n_compare))
+						exit(EXIT_FAILURE);
+				config.pool = &pool;
+		}
 
-						/* Send ACK (for each received packet) */
-						ack_packet = prep_packet(ACK, exp_seqnum, last_received, NULL, 0);
-						debug_print_packet(ack_packet);
-						load_and_send_packet(ack_packet,
-											 pkt_buffer,
-											 sockfd,
-											 (struct sockaddr*)&from_addr,
-											 from_addrlen);
-						free_packet(ack_packet);
-
-						/* Handle image (create struct and compare to loaded file array) */
-						/* Combine basename with directory (from argv) */
-						matching_file = compare_to_all_files(&fa, recv_f);
-						if (matching_file) {
-								tmp_string = concat_strings_nl(recv_f->filename, matching_file->filename);
-						} else {
-								debug("No matching image!");
-								tmp_string = concat_strings_nl(recv_f->filename, "UNKOWN");
-						}
-						/* Write result from image compare to output file */
-						write_to_file(tmp_string, output_fd);
-						free(tmp_string);
-						free_file(recv_f);
-
-
-				} /* else if (last_received == recv_pkt->seqnum) */
-				else if (already_received(recv_pkt->seqnum, exp_seqnum, WINSIZE, max_no_seqnums)) {
-						/* (re)acknowledge a packet which is already received */
-						debug("Already received: ack and discard packet\n");
-						ack_packet = prep_packet(ACK, exp_seqnum, recv_pkt->seqnum, NULL, 0);
-						debug_print_packet(ack_packet);
-						load_and_send_packet(ack_packet,
-											 pkt_buffer,
-											 sockfd,
-											 (struct sockaddr*)&from_addr,
-											 from_addrlen);
-						free_packet(ack_packet);
-				} else {
-						debug(RED "Unexpected error" NRM ": couldn't identify seqnum. Might be out of bounds.\n");
+		workers = calloc(n_workers, sizeof(struct server));
+		if (NULL == workers) {
+				perror("main: malloc of workers");
+				exit(EXIT_FAILURE);
+		}
+		/* Bind sockets of all workers before any of them runs,
+		 * so the group of SO_REUSEPORT sockets (and the spread of clients) is fixed.
+		 */
+		for (i = 0; i < n_workers; i++) {
+				workers[i] = config;
+				workers[i].id = i;
+				if (SUCCESS != init_worker(&workers[i], argv[1]))
+						exit(EXIT_FAILURE);
+		}
+		n_started = 0;
+		for (i = 0; i < n_workers; i++) {
+				if (0 != pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+						fprintf(stderr, "Error in main: could not start worker %d.\n", i);
+						break;
 				}
-				free_packet(recv_pkt);
+				n_started++;
 		}
+		if (n_workers > 1)
+				printf("%d of %d workers running.\n", n_started, n_workers);
+
+		/* Wait for Ctrl-C or kill (unless no worker could be started) */
+		if (n_started > 0 && 0 != sigwait(&stop_signals, &sig))
+				fprintf(stderr, "Error in main: sigwait failed.\n");
+
+		/* Wake up all workers (eventfd stays readable) and wait for them */
+		one = 1;
+		if (-1 == write(config.stop_fd, &one, sizeof one))
+				perror("main, write to stop eventfd");
+		for (i = 0; i < n_started; i++)
+				pthread_join(workers[i].thread, NULL);
+		if (watch_refs)
+				ref_watch_stop(&watch);
+		/* Files handed over before workers stopped are still compared and written */
+		if (config.pool)
+				compare_pool_stop(config.pool);
+		if (refs.scan)
+				scan_pool_stop(refs.scan);
 
 		/* Cleanup */
-		free_file_array(&fa);
+		init_batch_stats(&total_stats);
+		memset(&total_acks, 0, sizeof(struct ack_stats));
+		open_sessions = 0;
+		for (i = 0; i < n_workers; i++) {
+				if (n_workers > 1)
+						printf("Worker %d: %lu DATA packets, %d open sessions\n",
+							   i, workers[i].ack_stats.data_pkts, workers[i].sessions.entries);
+				add_batch_stats(&total_stats, &workers[i].stats);
+				total_acks.data_pkts += workers[i].ack_stats.data_pkts;
+				total_acks.acks += workers[i].ack_stats.acks;
+				total_acks.immediate += workers[i].ack_stats.immediate;
+				total_acks.timer += workers[i].ack_stats.timer;
+				open_sessions += workers[i].sessions.entries;
+				free_worker(&workers[i]);
+		}
+		printf("\nStopping server (%d open sessions).\n", open_sessions);
+		if (config.batch_mode)
+				print_batch_stats(&total_stats);
+		printf("ACKs: %lu sent for %lu DATA packets (%lu immediate, %lu by delayed ACK timer)\n",
+			   total_acks.acks, total_acks.data_pkts, total_acks.immediate, total_acks.timer);
+		printf("Lookups: %lu files, %lu rejected from header (no reference image with their dimensions)\n",
+			   refs.lookups, refs.header_rejects);
+		free(workers);
+		close(config.stop_fd);
+		/* No lookups or updates left: last snapshot owns the files */
+		ref_set_free(rcu_read(&refs.set), true);
+		/* After files which may point into it */
+		if (index_path)
+				index_file_close(&ixf);
 		free_string_array(&sa);
 		fclose(output_fd);
-		close(sockfd);
-		freeaddrinfo(addrs);
 
 		printf("\n--- Successfully finished ---\n");
 		return 0;
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "network.h"
+#include "session.h"
+
+
+/* Frees session and any file it was in the middle of receiving */
+static void free_session(struct session *s)
+{
+		uint32_t i;
+		free_reassembly(&s->reasm);
+		if (s->reorder) {
+				for (i = 0; i <= s->reorder_mask; i++)
+						free(s->reorder[i].buf);
+				free(s->reorder);
+		}
+		free(s);
+}
+
+/* Hash of peer address (address and port), used to pick bucket */
+static unsigned int hash_peer(struct sockaddr_storage *addr)
+{
+		struct sockaddr_in *in4;
+		struct sockaddr_in6 *in6;
+		unsigned int h, i;
+
+		h = 2166136261u;  /* FNV-1a */
+		if (AF_INET == addr->ss_family) {
+				in4 = (struct sockaddr_in*) addr;
+				h = (h ^ in4->sin_addr.s_addr) * 16777619u;
+				h = (h ^ in4->sin_port) * 16777619u;
+		} else if (AF_INET6 == addr->ss_family) {
+				in6 = (struct sockaddr_in6*) addr;
+				for (i = 0; i < sizeof(in6->sin6_addr); i++)
+						h = (h ^ in6->sin6_addr.s6_addr[i]) * 16777619u;
+				h = (h ^ in6->sin6_port) * 16777619u;
+		}
+		return h & (SESSION_BUCKETS - 1);
+}
+
+void init_session_table(struct session_table *st)
+{
+		int i;
+		st->entries = 0;
+		for (i = 0; i < SESSION_BUCKETS; i++)
+				st->buckets[i] = NULL;
+}
+
+bool same_peer(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+		struct sockaddr_in *a4, *b4;
+		struct sockaddr_in6 *a6, *b6;
+
+		if (a->ss_family != b->ss_family)
+				return false;
+		if (AF_INET == a->ss_family) {
+				a4 = (struct sockaddr_in*) a;
+				b4 = (struct sockaddr_in*) b;
+				return a4->sin_port == b4->sin_port
+						&& a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+		}
+		if (AF_INET6 == a->ss_family) {
+				a6 = (struct sockaddr_in6*) a;
+				b6 = (struct sockaddr_in6*) b;
+				return a6->sin6_port == b6->sin6_port
+						&& 0 == memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+		}
+		return false;
+}
+
+struct session *get_session(struct session_table *st, struct sockaddr_storage *addr)
+{
+		struct session *s;
+		for (s = st->buckets[hash_peer(addr)]; s != NULL; s = s->next) {
+				if (same_peer(&s->addr, addr))
+						return s;
+		}
+		return NULL;
+}
+
+struct session *add_session(struct session_table *st, struct sockaddr_storage *addr, socklen_t addrlen,
+							uint32_t peer_window, uint32_t max_window)
+{
+		struct session *s;
+		unsigned int bucket;
+
+		s = malloc(sizeof(struct session));
+		if (NULL == s) {
+				perror("Error in add_session during malloc");
+				return NULL;
+		}
+		memset(s, 0, sizeof(struct session));
+		memcpy(&s->addr, addr, addrlen);
+		s->addrlen = addrlen;
+		addr_to_string((struct sockaddr*) addr, addrlen, s->name, SESSION_NAME_LEN);
+		s->exp_seqnum = 0;
+		s->last_received = 0;
+		s->last_active = time(NULL);
+		s->peer_window = (0 == peer_window) ? DEFAULT_WINSIZE : peer_window;
+		s->window = (s->peer_window < max_window) ? s->peer_window : max_window;
+		s->unacked = 0;
+		s->ack_pending = false;
+		init_reassembly(&s->reasm);
+		s->reorder_mask = 1;
+		while (s->reorder_mask < s->window)
+				s->reorder_mask *= 2;
+		s->reorder_mask -= 1;
+		s->reorder = calloc(s->reorder_mask + 1, sizeof(struct reorder_slot));
+		if (NULL == s->reorder) {
+				perror("Error in add_session during calloc");
+				free(s);
+				return NULL;
+		}
+
+		/* Insert at front of bucket */
+		bucket = hash_peer(addr);
+		s->next = st->buckets[bucket];
+		st->buckets[bucket] = s;
+		st->entries += 1;
+
+		snprintf(debug_buf, DEBUG_BUFSIZE, "New session for %s (%d active), window %u\n",
+				 s->name, st->entries, s->window); /* DEBUG */
+		debugf(debug_buf);  /* DEBUG */
+		return s;
+}
+
+void remove_session(struct session_table *st, struct session *s)
+{
+		struct session **pp;
+		for (pp = &st->buckets[hash_peer(&s->addr)]; *pp != NULL; pp = &(*pp)->next) {
+				if (*pp == s) {
+						*pp = s->next;
+						st->entries -= 1;
+						free_session(s);
+						return;
+				}
+		}
+		fprintf(stderr, RED "Warning:" NRM " trying to remove session which is not in table.\n");
+}
+
+int evict_idle_sessions(struct session_table *st, time_t now, int idle_secs)
+{
+		struct session **pp, *s;
+		int i, evicted;
+		evicted = 0;
+		for (i = 0; i < SESSION_BUCKETS; i++) {
+				pp = &st->buckets[i];
+				while (*pp) {
+						s = *pp;
+						if (now - s->last_active >= idle_secs) {
+								printf("Session %s idle for %lds, evicting.\n", s->name, (long) (now - s->last_active));
+								*pp = s->next;
+								st->entries -= 1;
+								free_session(s);
+								evicted++;
+						} else {
+								pp = &s->next;
+						}
+				}
+		}
+		return evicted;
+}
+
+void free_session_table(struct session_table *st)
+{
+		struct session *s, *next;
+		int i;
+		for (i = 0; i < SESSION_BUCKETS; i++) {
+				for (s = st->buckets[i]; s != NULL; s = next) {
+						next = s->next;
+						free_session(s);
+				}
+				st->buckets[i] = NULL;
+		}
+		st->entries = 0;
+}
+
+bool buffer_packet(struct session *s, uint32_t seqnum, char *buf, int len)
+{
+		struct reorder_slot *slot;
+		char *copy;
+		slot = &s->reorder[seqnum & s->reorder_mask];
+		if (slot->buf)
+				return false;
+		copy = malloc(len);
+		if (NULL == copy) {
+				perror("Error in buffer_packet during malloc");
+				return false;
+		}
+		memcpy(copy, buf, len);
+		slot->buf = copy;
+		slot->len = len;
+		slot->seqnum = seqnum;
+		return true;
+}
+
+char *get_buffered_packet(struct session *s, uint32_t seqnum, int *len)
+{
+		struct reorder_slot *slot;
+		slot = &s->reorder[seqnum & s->reorder_mask];
+		if (NULL == slot->buf || slot->seqnum != seqnum)
+				return NULL;
+		*len = slot->len;
+		return slot->buf;
+}
+
+void release_buffered_packet(struct session *s, uint32_t seqnum)
+{
+		struct reorder_slot *slot;
+		slot = &s->reorder[seqnum & s->reorder_mask];
+		if (slot->buf && slot->seqnum == seqnum) {
+				free(slot->buf);
+				slot->buf = NULL;
+		}
+}
@@ -0,0 +1,140 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#include "network.h"
+
+
+/* =============================
+ * ====== CONSTS and VARS ======
+ * =============================
+ */
+/* Number of buckets in the session table (power of two) */
+#define SESSION_BUCKETS 64
+
+/* Seconds without traffic before a session is evicted.
+ * Covers clients whose TERM-packet was lost, or which died mid-transfer.
+ */
+#define SESSION_IDLE_TIMEOUT 30
+
+/* Room for "<ipv6-address>:<port>" */
+#define SESSION_NAME_LEN 64
+
+
+/* =======================
+ * ======= STRUCTS =======
+ * =======================
+ */
+
+/* Copy of a packet received ahead of the expected one (Selective Repeat).
+ * buf:    the packet (NULL if slot is empty).
+ * len:    length of packet.
+ * seqnum: seqnum of packet.
+ */
+struct reorder_slot {
+		char *buf;
+		int len;
+		uint32_t seqnum;
+};
+
+/* Receive state for one client (peer), keyed by the address recvfrom returns.
+ *
+ * addr, addrlen:  address of peer (as filled in by recvfrom).
+ * name:           printable "address:port" of peer (for output/debug).
+ * exp_seqnum:     sequence number expected next from this peer (Go-Back-N).
+ * last_received:  sequence number of last packet handled in order.
+ * last_active:    time of last packet from peer (used for idle eviction).
+ * listener:       index of server socket peer sends to (ACKs are sent from it).
+ * peer_window:    window advertised by peer (max number of packets it has in flight).
+ * window:         window of this session: peer_window, bounded by the server's max window.
+ *                 Advertised back to peer in every ACK.
+ * unacked:        packets accepted in order since last ACK to peer (delayed ACKs).
+ * ack_pending:    an ACK is being held back, and must be sent at ack_deadline at the latest.
+ * ack_deadline:   time (monotonic clock) delayed ACK must be sent.
+ * reasm:          reassembly buffer for the file peer is currently sending.
+ * reorder:        slots for packets received ahead of exp_seqnum (Selective Repeat),
+ *                 slot seqnum & reorder_mask.
+ * reorder_mask:   number of reorder slots - 1. The slots are window rounded up to
+ *                 a power of two, so packets in the window never share a slot,
+ *                 also when seqnum wraps around at 2^32.
+ * next:           next session in the same bucket (or NULL).
+ */
+struct session {
+		struct sockaddr_storage addr;
+		socklen_t addrlen;
+		char name[SESSION_NAME_LEN];
+		uint32_t exp_seqnum;
+		uint32_t last_received;
+		time_t last_active;
+		int listener;
+		uint32_t peer_window;
+		uint32_t window;
+		uint32_t unacked;
+		bool ack_pending;
+		struct timespec ack_deadline;
+		struct reassembly reasm;
+		struct reorder_slot *reorder;
+		uint32_t reorder_mask;
+		struct session *next;
+};
+
+/* Hash table of sessions. Each bucket is a linked list of sessions.
+ * Use init_session_table before use, and free_session_table when finished.
+ * entries: number of sessions currently in table.
+ */
+struct session_table {
+		int entries;
+		struct session *buckets[SESSION_BUCKETS];
+};
+
+
+/* ================================
+ * ======= SESSION FUNCTIONS ======
+ * ================================
+ */
+
+/* Set all buckets to NULL and entries to 0 */
+void init_session_table(struct session_table *st);
+
+/* Returns true if the two addresses are the same peer (family, address and port) */
+bool same_peer(struct sockaddr_storage *a, struct sockaddr_storage *b);
+
+/* Returns the session belonging to peer <addr>, or NULL if there is none. */
+struct session *get_session(struct session_table *st, struct sockaddr_storage *addr);
+
+/* Creates a new session for peer <addr> (with fresh receive state) and adds it to table.
+ * peer_window is the window advertised by peer (DEFAULT_WINSIZE is used if 0),
+ * the session window is peer_window bounded by max_window.
+ * Returns pointer to the session, or NULL on error (message is printed).
+ */
+struct session *add_session(struct session_table *st, struct sockaddr_storage *addr, socklen_t addrlen,
+							uint32_t peer_window, uint32_t max_window);
+
+/* Unlinks session from table and frees it (including unfinished reassembly) */
+void remove_session(struct session_table *st, struct session *s);
+
+/* Removes all sessions which has not been active for <idle_secs> seconds.
+ * Returns number of sessions evicted.
+ */
+int evict_idle_sessions(struct session_table *st, time_t now, int idle_secs);
+
+/* Copies packet (len bytes in buf) with <seqnum> to reorder buffer of session.
+ * Returns false if a packet with seqnum is already buffered (or on malloc error).
+ */
+bool buffer_packet(struct session *s, uint32_t seqnum, char *buf, int len);
+
+/* Returns buffered packet with <seqnum> (length in *len), or NULL if not buffered */
+char *get_buffered_packet(struct session *s, uint32_t seqnum, int *len);
+
+/* Frees buffered packet with <seqnum> (if any) */
+void release_buffered_packet(struct session *s, uint32_t seqnum);
+
+/* Frees all sessions in table */
+void free_session_table(struct session_table *st);
+
+#endif /* SESSION_H */
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "my_constants.h"
+#include "debug_print.h"
+#include "files.h"
+#include "rcu.h"
+#include "ref_set.h"
+#include "compare_pool.h"
+
+/* Stress test of the compare pool: several producer threads submit files at once
+ * (as the server workers do with -t), while several compare threads take them.
+ * Every file must be written once, each producer's files in the order submitted,
+ * and compare_pool_stop must return (no compare thread left waiting).
+ */
+
+/* Necessary for formatted debug printing (used by files.c) */
+__thread char debug_buf[DEBUG_BUFSIZE];
+int debug_mode;
+
+#define DEFAULT_PRODUCERS 16
+#define DEFAULT_COMPARE_THREADS 8
+#define DEFAULT_FILES 5000
+#define ROUNDS 50
+
+/* Seconds a round may take before the pool is taken to be stuck */
+#define ROUND_TIMEOUT 60
+
+/* Smallest valid image: header is parsed, but no reference has its dimensions */
+static const char tiny_pgm[] = "P2\n1 1\n255\n0\n";
+
+struct producer {
+		pthread_t thread;
+		struct compare_pool *pool;
+		int id;
+		int n_files;
+};
+
+static void on_alarm(int sig)
+{
+		(void) sig;
+		static const char msg[] = "FAILED: compare pool stuck (round timed out).\n";
+		if (write(STDERR_FILENO, msg, sizeof msg - 1)) {;}
+		_exit(EXIT_FAILURE);
+}
+
+/* Returns malloced file named "p<producer>_<i>" with the bytes of tiny_pgm */
+static struct file *new_file(int producer, int i)
+{
+		struct file *f;
+		char name[32];
+		f = malloc(sizeof(struct file));
+		if (NULL == f)
+				return NULL;
+		snprintf(name, sizeof name, "p%d_%d", producer, i);
+		f->filename = strdup(name);
+		f->bytes = malloc(sizeof tiny_pgm - 1);
+		if (NULL == f->filename || NULL == f->bytes) {
+				free(f->filename);
+				free(f->bytes);
+				free(f);
+				return NULL;
+		}
+		memcpy(f->bytes, tiny_pgm, sizeof tiny_pgm - 1);
+		f->n_bytes = sizeof tiny_pgm - 1;
+		f->img = NULL;
+		f->malformed = false;
+		f->mapped = false;
+		f->hashed = false;
+		f->mtime.tv_sec = 0;
+		f->mtime.tv_nsec = 0;
+		return f;
+}
+
+static void *producer_thread(void *arg)
+{
+		struct producer *p;
+		struct file *f;
+		int i;
+		p = arg;
+		for (i = 0; i < p->n_files; i++) {
+				f = new_file(p->id, i);
+				if (NULL == f) {
+						perror("producer_thread: malloc");
+						exit(EXIT_FAILURE);
+				}
+				compare_pool_submit(p->pool, f);
+		}
+		return NULL;
+}
+
+/* Checks output: every file once, each producer's in order. Returns number of errors. */
+static int check_output(FILE *fh, int n_producers, int n_files)
+{
+		char line[64], result[32];
+		int *next, producer, i, lines, errors;
+
+		next = calloc(n_producers, sizeof(int));
+		if (NULL == next) {
+				perror("check_output: calloc");
+				return 1;
+		}
+		rewind(fh);
+		lines = 0;
+		errors = 0;
+		while (fgets(line, sizeof line, fh)) {
+				lines++;
+				if (3 != sscanf(line, "p%d_%d %31s", &producer, &i, result)
+					|| producer < 0 || producer >= n_producers || i != next[producer]) {
+						if (errors++ < 10)
+								fprintf(stderr, "Unexpected line %d: %s", lines, line);
+						continue;
+				}
+				next[producer]++;
+		}
+		if (lines != n_producers * n_files) {
+				fprintf(stderr, "%d lines written, expected %d.\n", lines, n_producers * n_files);
+				errors++;
+		}
+		free(next);
+		return errors;
+}
+
+int main(int argc, char *argv[])
+{
+		struct references refs;
+		struct compare_pool pool;
+		struct file_array fa;
+		struct ref_set *set;
+		struct producer *producers;
+		FILE *out;
+		int n_producers, n_threads, n_files, round, i, errors;
+
+		n_producers = (argc > 1) ? atoi(argv[1]) : DEFAULT_PRODUCERS;
+		n_threads = (argc > 2) ? atoi(argv[2]) : DEFAULT_COMPARE_THREADS;
+		n_files = (argc > 3) ? atoi(argv[3]) : DEFAULT_FILES;
+		if (n_producers < 1 || n_threads < 1 || n_threads > MAX_COMPARE_THREADS || n_files < 1) {
+				fprintf(stderr, "Usage: ./stress_compare_pool [<producers>] [<compare threads (1-%d)>] [<files per producer>]\n",
+						MAX_COMPARE_THREADS);
+				exit(EXIT_FAILURE);
+		}
+		debug_mode = 0;
+		signal(SIGALRM, on_alarm);
+
+		/* No reference images: every file is looked up, and rejected from its header */
+		fa.entries = 0;
+		fa.total_size = 0;
+		fa.files = NULL;
+		set = ref_set_build(&fa, false);
+		if (NULL == set)
+				exit(EXIT_FAILURE);
+		rcu_init(&refs.set, set);
+		refs.scan = NULL;
+		refs.lookups = 0;
+		refs.header_rejects = 0;
+
+		producers = malloc(n_producers * sizeof(struct producer));
+		if (NULL == producers) {
+				perror("main: malloc");
+				exit(EXIT_FAILURE);
+		}
+		errors = 0;
+		for (round = 0; round < ROUNDS && 0 == errors; round++) {
+				out = tmpfile();
+				if (NULL == out) {
+						perror("main: tmpfile");
+						exit(EXIT_FAILURE);
+				}
+				alarm(ROUND_TIMEOUT);
+				if (SUCCESS != compare_pool_start(&pool, &refs, out, n_threads))
+						exit(EXIT_FAILURE);
+				for (i = 0; i < n_producers; i++) {
+						producers[i].pool = &pool;
+						producers[i].id = i;
+						producers[i].n_files = n_files;
+						if (0 != pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i])) {
+								fprintf(stderr, "Error in main: could not start producer %d.\n", i);
+								exit(EXIT_FAILURE);
+						}
+				}
+				for (i = 0; i < n_producers; i++)
+						pthread_join(producers[i].thread, NULL);
+				compare_pool_stop(&pool);
+				alarm(0);
+				errors = check_output(out, n_producers, n_files);
+				fclose(out);
+		}
+
+		free(producers);
+		ref_set_free(set, true);
+		if (errors) {
+				printf("FAILED: %d errors in round %d.\n", errors, round);
+				return EXIT_FAILURE;
+		}
+		printf("OK: %d rounds, %d producers, %d compare threads, %d files each.\n",
+			   ROUNDS, n_producers, n_threads, n_files);
+		return EXIT_SUCCESS;
+}